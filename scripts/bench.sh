@@ -0,0 +1,203 @@
+#!/bin/sh
+#
+# Time fastblur binaries on the bench corpus.
+#
+# Usage: scripts/bench.sh [-n RUNS] [-q] BINARY...
+#
+# Every configuration is run RUNS times on every image in the corpus
+# and the best wall time is reported. When more than one binary is
+# given, the speedup of each binary relative to the first one is shown.
+# The corpus defaults to res/*.png and can be overridden by setting
+# FASTBLUR_BENCH_CORPUS to a list of image files.
+#
+# A second table compares --half-chroma with the full blur on the first
+# binary, with the speedup and the PSNR of the difference in dB, over
+# all images of the corpus. Its last line is the PSNR on a checkerboard
+# of saturated red, blue and white, where out of gamut values show up.
+#
+# With -q nothing is timed or printed, every configuration is just run
+# once. This is used to train profile-guided builds.
+
+runs=3
+quiet=0
+
+while getopts "n:q" opt; do
+    case $opt in
+        n) runs=$OPTARG ;;
+        q) quiet=1; runs=1 ;;
+        *) echo "usage: $0 [-n RUNS] [-q] BINARY..." >&2; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 [-n RUNS] [-q] BINARY..." >&2
+    exit 2
+fi
+
+corpus=${FASTBLUR_BENCH_CORPUS:-$(ls res/*.png)}
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+# Typical configurations: several sizes, 2-6 passes, both gamma modes,
+# with and without resize.
+configs="\
+-p 2 -z 15
+-p 3 -z 49
+-p 4 -z 31
+-p 6 -z 101
+-G -p 4 -z 31
+-G -p 6 -z 9
+-r 1920x1080 -p 4 -z 61
+-r 2048x2048 -p 5 -z 49
+-G -r 256x256 -p 2 -z 7
+-r 1024x768@0.2 -p 3 -z 25"
+
+now_ms()
+{
+    echo $(($(date +%s%N) / 1000000))
+}
+
+# Best of $runs wall time in milliseconds for one invocation.
+time_run()
+{
+    best=
+    i=0
+    while [ $i -lt "$runs" ]; do
+        start=$(now_ms)
+        "$@" > /dev/null || exit 1
+        t=$(($(now_ms) - start))
+        if [ -z "$best" ] || [ $t -lt $best ]; then
+            best=$t
+        fi
+        i=$((i + 1))
+    done
+    echo $best
+}
+
+if [ $quiet -eq 0 ]; then
+    printf "%-32s" "config"
+    for bin in "$@"; do
+        printf "%16s" "$(basename "$(dirname "$bin")")/$(basename "$bin")"
+    done
+    printf "\n"
+fi
+
+echo "$configs" | while read -r config; do
+    base=
+    line=$(printf "%-32s" "$config")
+    for bin in "$@"; do
+        t=0
+        for img in $corpus; do
+            # shellcheck disable=SC2086
+            dt=$(time_run "$bin" $config "$img" "$out/out.png") || exit 1
+            t=$((t + dt))
+        done
+
+        if [ -z "$base" ]; then
+            base=$t
+            line="$line$(printf "%14dms" $t)"
+        else
+            line="$line$(printf "%8dms %5sx" $t \
+                "$(echo "$base $t" | awk '{ printf "%.2f", $1 / ($2 ? $2 : 1) }')")"
+        fi
+    done
+    if [ $quiet -eq 0 ]; then
+        echo "$line"
+    fi
+done
+
+# PSNR in dB between two raw 8-bit files of the same size.
+psnr()
+{
+    n=$(wc -c < "$1")
+    cmp -l "$1" "$2" | awk -v n="$n" '
+        function oct(s,    v, i) {
+            v = 0
+            for (i = 1; i <= length(s); i++)
+                v = 8 * v + substr(s, i, 1)
+            return v
+        }
+        { d = oct($2) - oct($3); sse += d * d }
+        END {
+            if (sse == 0) print "inf"
+            else printf "%.2f", 10 * log(255 * 255 * n / sse) / log(10)
+        }'
+}
+
+# A raw RGB checkerboard of 8x8 blocks of saturated red, blue and white.
+checker_rgb()
+{
+    y=0
+    while [ $y -lt 64 ]; do
+        x=0
+        while [ $x -lt 8 ]; do
+            case $(((x + y / 8) % 3)) in
+                0) px='\377\000\000' ;;
+                1) px='\000\000\377' ;;
+                2) px='\377\377\377' ;;
+            esac
+            printf "$px$px$px$px$px$px$px$px"
+            x=$((x + 1))
+        done
+        y=$((y + 1))
+    done
+}
+
+# Raw RGB copies of the corpus, for comparing outputs with --stream
+bin=$1
+i=0
+for img in $corpus; do
+    "$bin" --split 1 "$img" "$out/src$i" || exit 1
+    tail -n +5 "$out/src$i.0.ppm" > "$out/src$i.rgb"
+    i=$((i + 1))
+done
+
+if [ $quiet -eq 0 ]; then
+    printf "\n%-32s%16s%16s%8s%10s\n" "half chroma" "full" "half" "" "psnr"
+fi
+
+echo "$configs" | while read -r config; do
+    full=0
+    half=0
+    rm -f "$out/full.rgb" "$out/half.rgb"
+    i=0
+    for img in $corpus; do
+        # shellcheck disable=SC2086
+        dt=$(time_run "$bin" $config "$img" "$out/out.png") || exit 1
+        full=$((full + dt))
+        # shellcheck disable=SC2086
+        dt=$(time_run "$bin" --half-chroma $config "$img" "$out/out.png") \
+            || exit 1
+        half=$((half + dt))
+
+        size=$(sed -n 3p "$out/src$i.0.ppm" | tr ' ' x)
+        # shellcheck disable=SC2086
+        "$bin" --stream --raw "$size:rgb" $config "$out/src$i.rgb" - \
+            >> "$out/full.rgb" 2> /dev/null || exit 1
+        # shellcheck disable=SC2086
+        "$bin" --stream --raw "$size:rgb" --half-chroma $config \
+            "$out/src$i.rgb" - >> "$out/half.rgb" 2> /dev/null || exit 1
+        i=$((i + 1))
+    done
+
+    if [ $quiet -eq 0 ]; then
+        printf "%-32s%14dms%14dms %5sx%8sdB\n" "$config" $full $half \
+            "$(echo "$full $half" | awk '{ printf "%.2f", $1 / ($2 ? $2 : 1) }')" \
+            "$(psnr "$out/full.rgb" "$out/half.rgb")"
+    fi
+done
+
+checker_rgb > "$out/checker.rgb"
+checker_config="-p 3 -z 9"
+# shellcheck disable=SC2086
+"$bin" --stream --raw 64x64:rgb $checker_config "$out/checker.rgb" \
+    "$out/full.rgb" 2> /dev/null || exit 1
+# shellcheck disable=SC2086
+"$bin" --stream --raw 64x64:rgb --half-chroma $checker_config \
+    "$out/checker.rgb" "$out/half.rgb" 2> /dev/null || exit 1
+
+if [ $quiet -eq 0 ]; then
+    printf "%-32s%16s%16s%8s%8sdB\n" "saturated edges $checker_config" "" "" \
+        "" "$(psnr "$out/full.rgb" "$out/half.rgb")"
+fi
@@ -0,0 +1,95 @@
+#!/bin/sh
+#
+# Check that batch and stream runs stop allocating buffers once they
+# have warmed up.
+#
+# Usage: scripts/check.sh BINARY
+#
+# BINARY should be a debug build, as built by make check, which counts
+# calls to malloc, calloc and realloc. Stream mode asserts that none are
+# made after the temporal window has filled up. Batch runs of 5 and 8
+# windows of the same image must report the same scratch allocation
+# count in their --metrics file; the image codecs allocate for every
+# image, so only the scratch pool is counted there. Both use one thread,
+# since with more the buffers a run needs depend on scheduling.
+
+if [ $# -ne 1 ]; then
+    echo "usage: $0 BINARY" >&2
+    exit 2
+fi
+
+bin=$1
+src=res/peppers.png
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+configs="\
+-z 5
+-r 128x96 -z 9 --unsharp 0.5
+-r 128x96 -z 31 --engine dual
+-r 128x96 -z 9 --half-chroma
+-r 128x96 --guided 3
+-r 128x96 --tilt-shift 0.5,0.2,21
+-r 128x96 --dilate 4 -z 5"
+
+failed=0
+
+report()
+{
+    if [ "$1" -eq 0 ]; then
+        printf "%-8s%-40sok\n" "$2" "$3"
+    else
+        printf "%-8s%-40sFAIL\n" "$2" "$3"
+        failed=1
+    fi
+}
+
+# Allocations reported by a batch run of $1 copies of the source image.
+batch_allocations()
+{
+    n=$1
+    shift
+    set -- "$@" --batch --metrics "$out/metrics.prom"
+    i=0
+    while [ $i -lt "$n" ]; do
+        set -- "$@" "$src" "$out/batch$i.png"
+        i=$((i + 1))
+    done
+
+    "$bin" -j 1 "$@" 2> /dev/null || return 1
+    awk '$1 == "fastblur_batch_scratch_allocations_total" { print $2 }' \
+        "$out/metrics.prom"
+}
+
+# Eight raw RGB frames of the source image
+"$bin" --split 1 "$src" "$out/src" || exit 1
+size=$(sed -n 3p "$out/src.0.ppm" | tr ' ' x)
+tail -n +5 "$out/src.0.ppm" > "$out/frame.rgb"
+for i in 1 2 3 4 5 6 7 8; do
+    cat "$out/frame.rgb"
+done > "$out/frames.rgb"
+
+# The loops run in subshells, which exit with their own failed flag
+printf "%s\n%s\n" "$configs" "-r 128x96 -z 9 --temporal 3" | {
+    while read -r config; do
+        # shellcheck disable=SC2086
+        "$bin" -j 1 --stream --raw "$size:rgb" $config "$out/frames.rgb" \
+            /dev/null 2> /dev/null
+        report $? stream "$config"
+    done
+    exit $failed
+} || failed=1
+
+echo "$configs" | {
+    while read -r config; do
+        # shellcheck disable=SC2086
+        warm=$(batch_allocations 80 $config)
+        # shellcheck disable=SC2086
+        steady=$(batch_allocations 128 $config)
+        [ -n "$warm" ] && [ "$warm" = "$steady" ]
+        report $? batch "$config"
+    done
+    exit $failed
+} || failed=1
+
+exit $failed
@@ -0,0 +1,362 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "aio.h"
+
+/*
+ * Largest single read or write. Longer transfers are split, which also
+ * handles short reads and writes.
+ */
+#define AIO_CHUNK (1u << 30)
+
+/*
+ * Asynchronous whole-file I/O for batch runs.
+ *
+ * Uses io_uring when the kernel supports it. Otherwise every transfer is
+ * done with pread/pwrite when it is submitted. An aio must only be used
+ * from one thread.
+ */
+struct aio {
+    int ring_fd;
+    unsigned in_flight;
+    unsigned depth;
+
+#ifdef HAVE_IO_URING
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    size_t sqes_size;
+#endif
+};
+
+static void aio_complete(struct aio_file *file, int error)
+{
+    file->error = error;
+    file->complete = true;
+    close(file->fd);
+}
+
+#ifdef HAVE_IO_URING
+
+static int ring_setup(struct aio *aio, unsigned depth)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = syscall(__NR_io_uring_setup, depth, &params);
+    if (fd < 0)
+        return -1;
+
+    aio->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    aio->cq_size = params.cq_off.cqes
+        + params.cq_entries * sizeof(struct io_uring_cqe);
+    aio->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        if (aio->cq_size > aio->sq_size)
+            aio->sq_size = aio->cq_size;
+        aio->cq_size = aio->sq_size;
+    }
+
+    aio->sq_ptr = mmap(NULL, aio->sq_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    aio->cq_ptr = single_mmap ? aio->sq_ptr : mmap(NULL, aio->cq_size,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+            IORING_OFF_CQ_RING);
+    aio->sqes = mmap(NULL, aio->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+    if (aio->sq_ptr == MAP_FAILED || aio->cq_ptr == MAP_FAILED
+            || aio->sqes == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    uint8_t *sq = aio->sq_ptr;
+    aio->sq_head = (unsigned *) (sq + params.sq_off.head);
+    aio->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    aio->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    aio->sq_array = (unsigned *) (sq + params.sq_off.array);
+
+    uint8_t *cq = aio->cq_ptr;
+    aio->cq_head = (unsigned *) (cq + params.cq_off.head);
+    aio->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    aio->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    aio->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    aio->ring_fd = fd;
+    aio->depth = params.sq_entries;
+
+    return 0;
+}
+
+static void ring_teardown(struct aio *aio)
+{
+    munmap(aio->sqes, aio->sqes_size);
+    if (aio->cq_ptr != aio->sq_ptr)
+        munmap(aio->cq_ptr, aio->cq_size);
+    munmap(aio->sq_ptr, aio->sq_size);
+    close(aio->ring_fd);
+}
+
+static int ring_enter(struct aio *aio, unsigned submit, unsigned wait)
+{
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, aio->ring_fd, submit, wait, flags,
+                NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret;
+}
+
+static void ring_submit(struct aio *aio, struct aio_file *file, bool write);
+
+/*
+ * Handle all available completions. Transfers that completed short are
+ * resubmitted for the remaining bytes.
+ */
+static void ring_reap(struct aio *aio)
+{
+    unsigned head = *aio->cq_head;
+    unsigned tail = __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &aio->cqes[head & *aio->cq_mask];
+        struct aio_file *file = (struct aio_file *)
+            (uintptr_t) (cqe->user_data & ~(uint64_t) 1);
+        bool write = cqe->user_data & 1;
+        int res = cqe->res;
+
+        head++;
+        __atomic_store_n(aio->cq_head, head, __ATOMIC_RELEASE);
+        aio->in_flight--;
+
+        if (res < 0) {
+            aio_complete(file, -res);
+        } else if (res == 0) {
+            aio_complete(file, EIO);
+        } else {
+            file->done += res;
+            if (file->done < file->size) {
+                ring_submit(aio, file, write);
+            } else {
+                aio_complete(file, 0);
+            }
+        }
+
+        tail = __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE);
+    }
+}
+
+static void ring_submit(struct aio *aio, struct aio_file *file, bool write)
+{
+    while (aio->in_flight >= aio->depth) {
+        ring_enter(aio, 0, 1);
+        ring_reap(aio);
+    }
+
+    unsigned tail = *aio->sq_tail;
+    unsigned index = tail & *aio->sq_mask;
+    struct io_uring_sqe *sqe = &aio->sqes[index];
+
+    size_t len = file->size - file->done;
+    if (len > AIO_CHUNK)
+        len = AIO_CHUNK;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = file->fd;
+    sqe->addr = (uintptr_t) (file->data + file->done);
+    sqe->len = len;
+    sqe->off = file->done;
+    // aio_file is at least 4-byte aligned, so the low bit is free to
+    // tell reads from writes.
+    sqe->user_data = (uintptr_t) file | write;
+
+    aio->sq_array[index] = index;
+    __atomic_store_n(aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    aio->in_flight++;
+
+    ring_enter(aio, 1, 0);
+}
+
+#endif /* HAVE_IO_URING */
+
+/*
+ * Transfer the whole file with pread/pwrite.
+ */
+static void sync_transfer(struct aio_file *file, bool write)
+{
+    while (file->done < file->size) {
+        size_t len = file->size - file->done;
+        if (len > AIO_CHUNK)
+            len = AIO_CHUNK;
+
+        ssize_t res = write
+            ? pwrite(file->fd, file->data + file->done, len, file->done)
+            : pread(file->fd, file->data + file->done, len, file->done);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0) {
+            aio_complete(file, res < 0 ? errno : EIO);
+            return;
+        }
+
+        file->done += res;
+    }
+
+    aio_complete(file, 0);
+}
+
+static void aio_submit(struct aio *aio, struct aio_file *file, bool write)
+{
+    if (file->size == 0) {
+        aio_complete(file, 0);
+        return;
+    }
+
+#ifdef HAVE_IO_URING
+    if (aio->ring_fd >= 0) {
+        ring_submit(aio, file, write);
+        return;
+    }
+#endif
+
+    sync_transfer(file, write);
+}
+
+/**
+ * Create an asynchronous I/O context with up to depth transfers in
+ * flight.
+ */
+struct aio *aio_create(int depth)
+{
+    struct aio *aio = calloc(1, sizeof(*aio));
+    aio->ring_fd = -1;
+
+#ifdef HAVE_IO_URING
+    if (getenv("FASTBLUR_NO_IO_URING") == NULL) {
+        ring_setup(aio, depth);
+    }
+#endif
+
+    return aio;
+}
+
+void aio_destroy(struct aio *aio)
+{
+    if (!aio)
+        return;
+
+#ifdef HAVE_IO_URING
+    if (aio->ring_fd >= 0)
+        ring_teardown(aio);
+#endif
+
+    free(aio);
+}
+
+/**
+ * Whether transfers run in the background with io_uring, or block when
+ * they are submitted because io_uring is unavailable or disabled with
+ * FASTBLUR_NO_IO_URING.
+ */
+bool aio_is_async(struct aio *aio)
+{
+    return aio->ring_fd >= 0;
+}
+
+/**
+ * Start reading a whole file into a newly allocated buffer.
+ *
+ * Returns 0, or an errno value if the file cannot be opened. Transfer
+ * errors are reported by aio_wait.
+ */
+int aio_read_file(struct aio *aio, struct aio_file *file, const char *pathname)
+{
+    memset(file, 0, sizeof(*file));
+
+    file->fd = open(pathname, O_RDONLY | O_CLOEXEC);
+    if (file->fd < 0)
+        return errno;
+
+    struct stat st;
+    if (fstat(file->fd, &st) < 0) {
+        int error = errno;
+        close(file->fd);
+        return error;
+    }
+
+    file->size = st.st_size;
+    file->data = malloc(file->size ? file->size : 1);
+
+    aio_submit(aio, file, false);
+
+    return 0;
+}
+
+/**
+ * Start writing size bytes of data to a file, replacing its contents.
+ *
+ * data must stay valid until aio_wait returns for the file.
+ */
+int aio_write_file(struct aio *aio, struct aio_file *file, const char *pathname,
+        uint8_t *data, size_t size)
+{
+    memset(file, 0, sizeof(*file));
+
+    file->fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (file->fd < 0)
+        return errno;
+
+    file->data = data;
+    file->size = size;
+
+    aio_submit(aio, file, true);
+
+    return 0;
+}
+
+/**
+ * Wait for a transfer to complete. Returns 0 or an errno value.
+ */
+int aio_wait(struct aio *aio, struct aio_file *file)
+{
+#ifdef HAVE_IO_URING
+    while (!file->complete) {
+        ring_reap(aio);
+        if (!file->complete)
+            ring_enter(aio, 0, 1);
+    }
+#endif
+
+    return file->error;
+}
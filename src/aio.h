@@ -0,0 +1,32 @@
+#ifndef AIO_H
+#define AIO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct aio;
+
+/*
+ * A whole-file read or write in flight. data is owned by the caller for
+ * writes, and allocated by aio_read_file for reads.
+ */
+struct aio_file {
+    int fd;
+    uint8_t *data;
+    size_t size;
+    size_t done;
+    int error;
+    bool complete;
+};
+
+struct aio *aio_create(int depth);
+void aio_destroy(struct aio *aio);
+bool aio_is_async(struct aio *aio);
+
+int aio_read_file(struct aio *aio, struct aio_file *file, const char *pathname);
+int aio_write_file(struct aio *aio, struct aio_file *file, const char *pathname,
+        uint8_t *data, size_t size);
+int aio_wait(struct aio *aio, struct aio_file *file);
+
+#endif /* AIO_H */
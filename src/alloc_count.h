@@ -0,0 +1,12 @@
+#ifndef ALLOC_COUNT_H
+#define ALLOC_COUNT_H
+
+/*
+ * Debug builds link with malloc, calloc and realloc wrapped, so that
+ * checks can tell whether a stretch of code allocated.
+ */
+#ifdef DEBUG
+unsigned long alloc_count(void);
+#endif
+
+#endif /* ALLOC_COUNT_H */
@@ -1,3 +1,6 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -5,105 +8,146 @@
 #include <stdarg.h>
 #include <math.h>
 #include <string.h>
-#include <time.h>
 
 #include <argp.h>
-
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "aio.h"
+#include "alloc_count.h"
+#include "img.h"
+#include "metrics.h"
+#include "pool.h"
+#include "probes.h"
+#include "roofline.h"
+#include "scratch.h"
 #include "stb_image.h"
 #include "stb_image_write.h"
 
-#define GAMMA 2.2f
-
-#define MIN(a, b) (((a) < (b)) ? (a) : (b))
-#define MAX(a, b) (((a) > (b)) ? (a) : (b))
-
-#define IDX(w, x, y, s) ((s) * ((w) * (y) + (x)))
-#define PTR_SWAP(a, b) { \
-    void *tmp = a; \
-    a = b; \
-    b = tmp; }
-
-#ifdef MEASURE_PERF_ENABLE
-#define TIMER_START(name) clock_t _timer_ ## name = clock()
-#define TIMER_END(name) \
-    { clock_t _timer_end_ = clock(); \
-        float _timer_duration_ms_ = 1000.0 * (_timer_end_ - _timer_ ## name) / CLOCKS_PER_SEC; \
-        printf(#name ": %.2fms\n", _timer_duration_ms_); }
-#else
-#define TIMER_START(name) (void) 0
-#define TIMER_END(name) (void) 0
-#endif /* MEASURE_PERF_ENABLE */
-
-struct img {
-    int width;
-    int height;
-    int stride;
-    bool owner;
-    size_t alloc_size;
-    float *pixels;
-};
+/*
+ * Maximum number of images packed into one multi-channel image in batch
+ * mode, and the maximum total pixel count of a pack.
+ */
+#define BATCH_LANES 16
+#define BATCH_PACK_PIXELS (1 << 21)
 
-struct geometry {
-    int width;
-    int height;
-    float anchor;
-};
+/*
+ * Number of windows ahead of the one being decoded for which batch mode
+ * reads input files.
+ */
+#define BATCH_PREFETCH 2
+
+/*
+ * Windows of images in flight in batch mode: one decoding, one blurring
+ * and one encoding.
+ */
+#define BATCH_WINDOWS 3
+
+/*
+ * Free buffers kept for the temporaries of one blur, enough for the
+ * levels of a dual filter pyramid.
+ */
+#define BLUR_SCRATCH_BUFFERS 16
+
+/*
+ * Free buffers batch mode keeps for reuse: the source and blurred images
+ * of each window in flight, the encoded bitmaps, the resize temporaries
+ * and those of the blur.
+ */
+#define BATCH_SCRATCH_BUFFERS ((2 * BATCH_WINDOWS + 2) * BATCH_LANES \
+        + BLUR_SCRATCH_BUFFERS)
+
+/*
+ * Free buffers stream mode keeps for reuse: a decoded frame, a resized
+ * one, an encoded one and the temporaries of the blur.
+ */
+#define STREAM_SCRATCH_BUFFERS (4 + BLUR_SCRATCH_BUFFERS)
+
+/*
+ * Free buffers frames mode keeps for reuse per thread: an image, its
+ * blurred copy, a temporary, a bitmap and the temporaries of the blur.
+ */
+#define FRAME_SCRATCH_BUFFERS (4 + BLUR_SCRATCH_BUFFERS)
+
+/*
+ * Minimum number of seconds between updates of the metrics file during a
+ * batch run. It is always written when the run completes.
+ */
+#define METRICS_INTERVAL 10.0
 
 enum crop_mode {
     CROP_NONE,
     CROP_FILL
 };
 
-enum pixel_format {
-    FORMAT_RGB,
-    FORMAT_RGBA,
-    FORMAT_ARGB,
-    FORMAT_BGR,
-    FORMAT_BGRA,
-    FORMAT_ABGR,
-
-    FORMAT_COUNT
-};
-
-struct raw_image_format {
-    enum pixel_format format;
-    int width;
-    int height;
+/*
+ * A horizontal strip of an image, blurred independently in tiled mode.
+ * The tile holds rows [y_begin, y_begin + height) of the full image, of
+ * which rows [own_begin, own_end) are its own. The other rows are only
+ * context for the blur.
+ */
+struct tile {
+    int index;
+    int count;
+    int full_height;
+    int y_begin;
+    int own_begin;
+    int own_end;
 };
 
 struct arguments {
     char *output_file;
     char *input_file;
+    char *metrics_file;
+    char **files;
+    int n_files;
     bool fast_gamma;
     bool raw_image;
+    bool batch;
+    bool unsharp;
+    float unsharp_amount;
+    float unsharp_threshold;
+    bool shadow;
+    uint8_t shadow_color[4];
+    bool stream;
+    int temporal;
+    bool adjust;
+    struct color_adjust color_adjust;
+    bool frames;
+    bool mipchain;
+    bool guided;
+    bool half_chroma;
+    bool tilt_shift;
+    struct tilt_shift tilt;
+    bool roofline;
+    int median_radius;
+    enum morph_op morph;
+    int morph_radius;
+    int guided_radius;
+    float guided_eps;
+    int split_count;
+    int tile_index;
+    bool merge;
+    int threads;
     unsigned blur_size;
     unsigned blur_passes;
+    enum blur_engine engine;
     enum crop_mode crop_mode;
     struct geometry geom;
+    struct geometry *geoms;
+    int n_geoms;
     struct raw_image_format raw_fmt;
 };
 
-static const int pixel_format_size[FORMAT_COUNT] = {
-    [FORMAT_RGB]  = 3,
-    [FORMAT_RGBA] = 4,
-    [FORMAT_ARGB] = 4,
-    [FORMAT_BGR]  = 3,
-    [FORMAT_BGRA] = 4,
-    [FORMAT_ABGR] = 4
+static const int pixel_format_alpha_offset[FORMAT_COUNT] = {
+    [FORMAT_RGB]  = -1,
+    [FORMAT_RGBA] = 3,
+    [FORMAT_ARGB] = 0,
+    [FORMAT_BGR]  = -1,
+    [FORMAT_BGRA] = 3,
+    [FORMAT_ABGR] = 0
 };
 
-static const int pixel_format_rgb_offset[FORMAT_COUNT][3] = {
-    [FORMAT_RGB]  = {0, 1, 2},
-    [FORMAT_RGBA] = {0, 1, 2},
-    [FORMAT_ARGB] = {1, 2, 3},
-    [FORMAT_BGR]  = {2, 1, 0},
-    [FORMAT_BGRA] = {2, 1, 0},
-    [FORMAT_ABGR] = {3, 2, 1}
-};
-
-
-float gamma_decode_lut[256];
-
 const char *argp_program_version =
     "fastblur 0.2.0";
 
@@ -127,423 +171,1676 @@ void fmt_error_and_exit(const char *format, ...)
     exit(EXIT_FAILURE);
 }
 
+uint8_t *file_read_all(char *pathname, size_t *size);
+
 /**
- * Set the size of an image.
+ * Load a bitmap with the given number of channels from an image file.
  *
- * Data may or may not be preserved. If the image already fits the
- * requested size, no allocations are made.
+ * Files are read into memory first, which lets stb_image decode the
+ * restart intervals of a JPEG in parallel. Standard input is decoded as
+ * a stream so that it is left right after the image.
  */
-void img_set_size(struct img *img, int width, int height)
+uint8_t *bitmap_load(char *pathname, int channels, int *width, int *height)
 {
-    img->width = width;
-    img->height = height;
-    int size = sizeof(float) * 3 * img->width * img->height;
-    img->stride = 3 * width;
-    if (!img->pixels || size > img->alloc_size) {
-        free(img->pixels);
-        img->alloc_size = size;
-        img->pixels = malloc(sizeof(float) * img->alloc_size * 3);
+    int file_channels;
+    bool use_stdin = (strcmp(pathname, "-") == 0);
+
+    PROBE0(load_start);
+    uint8_t *bitmap;
+    if (use_stdin) {
+        bitmap = stbi_load_from_file(stdin, width, height, &file_channels,
+                channels);
+    } else {
+        size_t size;
+        uint8_t *data = file_read_all(pathname, &size);
+        bitmap = stbi_load_from_memory(data, size, width, height,
+                &file_channels, channels);
+        free(data);
     }
+
+    if (!bitmap) {
+        fmt_error_and_exit("could not load image from %s", pathname);
+    }
+    PROBE3(load_end, *width, *height, channels);
+
+    return bitmap;
 }
 
 /**
- * Initialize an image to a size.
- *
- * img_set_size requires the image to be in a valid state. img_init sets
- * the image to a valid state and then calls img_set_size.
+ * Load a bitmap with the given number of channels from an image file in
+ * memory. pathname is only used for error messages.
  */
-void img_init(struct img *img, int w, int h)
+uint8_t *bitmap_load_memory(uint8_t *data, size_t size, char *pathname,
+        int channels, int *width, int *height)
 {
-    img->pixels = NULL;
-    img_set_size(img, w, h);
+    int file_channels;
+    PROBE0(load_start);
+    uint8_t *bitmap = stbi_load_from_memory(data, size, width, height,
+            &file_channels, channels);
+
+    if (!bitmap) {
+        fmt_error_and_exit("could not load image from %s", pathname);
+    }
+    PROBE3(load_end, *width, *height, channels);
+
+    return bitmap;
 }
 
 /**
- * Initialize the gamma decode lut.
- *
- * powf is slow. Use a lut to improve performance.
+ * Load a bitmap from a raw file.
  */
-void init_gamma_decode_lut()
+uint8_t *bitmap_load_raw(char *pathname, struct raw_image_format *raw_fmt)
 {
-    const float scale_factor = 1.0f / 255.0f;
+    int pixel_size = pixel_format_size[raw_fmt->format];
+    size_t raw_img_size = pixel_size * raw_fmt->width * raw_fmt->height;
 
-    for (size_t i = 0; i < 256; i++) {
-        gamma_decode_lut[i] = powf(i * scale_factor, GAMMA);
+    bool use_stdin = (strcmp(pathname, "-") == 0);
+    FILE *file = use_stdin ? stdin : fopen(pathname, "r");
+    if (!file) {
+        int errsv = errno;
+        char *err = strerror(errsv);
+        fmt_error_and_exit("cannot open '%s' (%s)", pathname, err);
     }
+
+    uint8_t *bitmap = malloc(raw_img_size);
+
+    size_t bytes_read = fread(bitmap, 1, raw_img_size, file);
+    if (bytes_read != raw_img_size) {
+        fmt_error_and_exit("unexpected eof before raw image end");
+    }
+
+    if (!use_stdin) {
+        fclose(file);
+    }
+
+    return bitmap;
 }
 
 /**
- * Decode gamma-encoded values.
- *
- * Fast gamma is an approximation that uses gamma=2.0 instead of the
- * usual 2.2 for sRGB. Fast gamma improves encoding performance since
- * there is no fast way to use a lut with floats.
+ * Load an image from a file and convert to linear colors.
  */
-float gamma_decode_fast(uint8_t v)
+void img_load(struct img *img, char *pathname, bool fast_gamma)
 {
-    static const float scale_factor = 1.0f / 255.0f;
+    int width, height;
+    uint8_t *bitmap = bitmap_load(pathname, 3, &width, &height);
+
+    struct raw_image_format format = { FORMAT_RGB, width, height };
+    img_gamma_decode_bitmap(img, bitmap, &format, fast_gamma);
 
-    float x = v * scale_factor;
-    return x * x;
+    free(bitmap);
+}
+
+void img_load_raw(struct img *img, char *pathname,
+        struct raw_image_format *raw_fmt, bool fast_gamma)
+{
+    uint8_t *bitmap = bitmap_load_raw(pathname, raw_fmt);
+    img_gamma_decode_bitmap(img, bitmap, raw_fmt, fast_gamma);
+    free(bitmap);
 }
 
 /**
- * Gamma-encode a linear value.
+ * Load the alpha channel of an image into a single channel image.
+ *
+ * Alpha is linear, so no gamma decoding is done. If raw_fmt is not NULL
+ * the file is read as a raw bitmap, which must have an alpha channel.
  */
-uint8_t gamma_encode(float v)
+void img_load_alpha(struct img *img, char *pathname,
+        struct raw_image_format *raw_fmt)
 {
-    static const float gamma_rcp = 1.0f / GAMMA;
+    static const float scale_factor = 1.0f / 255.0f;
+
+    struct raw_image_format format = { FORMAT_RGBA };
+    uint8_t *bitmap;
+    if (raw_fmt) {
+        format = *raw_fmt;
+        bitmap = bitmap_load_raw(pathname, &format);
+    } else {
+        bitmap = bitmap_load(pathname, 4, &format.width, &format.height);
+    }
 
-    return (uint8_t) (255.0f * powf(v, gamma_rcp) + 0.5f);
+    int alpha = pixel_format_alpha_offset[format.format];
+    if (alpha < 0) {
+        fmt_error_and_exit("raw image format has no alpha channel");
+    }
+
+    img_init(img, format.width, format.height, 1);
+
+    int pixel_size = pixel_format_size[format.format];
+    size_t n_pixels = (size_t) format.width * format.height;
+    for (size_t i = 0; i < n_pixels; i++) {
+        img->pixels[i] = scale_factor * bitmap[pixel_size * i + alpha];
+    }
+
+    free(bitmap);
+}
+
+struct png_buffer {
+    uint8_t *data;
+    size_t size;
+};
+
+static void png_buffer_write(void *context, void *data, int size)
+{
+    struct png_buffer *png = context;
+    png->data = malloc(size);
+    png->size = size;
+    memcpy(png->data, data, size);
 }
 
 /**
- * Gamma-encode a linear value.
- *
- * Uses the fast gamma approximation, which uses a call to sqrtf
- * instead of powf.
+ * Gamma-encode an image to a PNG file in memory. The bitmap is taken from
+ * scratch, which may be NULL.
  */
-uint8_t gamma_encode_fast(float v)
+struct png_buffer img_encode_png(struct img *img,
+        const struct encode_params *params, struct scratch *scratch)
 {
-    return (uint8_t) (255.0f * sqrtf(v) + 0.5f);
+    size_t capacity;
+    size_t size = (size_t) img->channels * img->width * img->height;
+    uint8_t *bitmap = scratch_get(scratch, size, &capacity);
+    img_gamma_encode_into(img, bitmap, params);
+
+    struct png_buffer png = { NULL, 0 };
+    int stride = img->channels * img->width;
+    PROBE3(png_start, img->width, img->height, img->channels);
+    stbi_write_png_to_func(png_buffer_write, &png, img->width, img->height,
+            img->channels, bitmap, stride);
+    PROBE1(png_end, png.size);
+    scratch_put(scratch, bitmap, capacity);
+
+    return png;
 }
 
-void img_gamma_decode_bitmap(struct img *img, uint8_t *bitmap,
-        struct raw_image_format *fmt, bool fast_gamma)
+/**
+ * Gamma-encode an image and save it. The bitmap is taken from scratch,
+ * which may be NULL.
+ */
+void img_save_png(struct img *img, char *pathname,
+        const struct encode_params *params, struct scratch *scratch)
 {
-    img_init(img, fmt->width, fmt->height);
+    size_t capacity;
+    size_t size = (size_t) img->channels * img->width * img->height;
+    uint8_t *bitmap = scratch_get(scratch, size, &capacity);
+    img_gamma_encode_into(img, bitmap, params);
+
+    int stride = img->channels * img->width;
+    PROBE3(png_start, img->width, img->height, img->channels);
+    stbi_write_png(pathname, img->width, img->height, img->channels, bitmap,
+            stride);
+    PROBE1(png_end, 0);
+    scratch_put(scratch, bitmap, capacity);
+}
 
-    int pixel_size = pixel_format_size[fmt->format];
-    int img_size = pixel_size * fmt->width * fmt->height;
-    const int *offset = pixel_format_rgb_offset[fmt->format];
+struct shadow_args {
+    struct img *alpha;
+    uint8_t *bitmap;
+    const uint8_t *color;
+};
 
-    for (size_t i = 0; i < img_size; i += pixel_size) {
-        for (size_t c = 0; c < 3; c++) {
-            if (fast_gamma) {
-                img->pixels[i + c] = gamma_decode_fast(bitmap[i + offset[c]]);
-            } else {
-                img->pixels[i + c] = gamma_decode_lut[bitmap[i + offset[c]]];
-            }
+static void encode_shadow_rows(void *ctx, int y0, int y1)
+{
+    struct shadow_args *args = ctx;
+    struct img *alpha = args->alpha;
+    const uint8_t *color = args->color;
+    float scale = color[3];
+
+    for (int y = y0; y < y1; y++) {
+        float *row = &alpha->pixels[alpha->stride * y];
+        uint8_t (*out_row)[4] = (uint8_t (*)[4]) &args->bitmap[4 * alpha->width * y];
+        for (int x = 0; x < alpha->width; x++) {
+            out_row[x][0] = color[0];
+            out_row[x][1] = color[1];
+            out_row[x][2] = color[2];
+            out_row[x][3] = (uint8_t) (scale * MIN(row[x], 1.0f) + 0.5f);
         }
     }
 }
 
-uint8_t *img_gamma_encode_to_bitmap(struct img *img, bool fast_gamma)
+/**
+ * Save a blurred alpha channel as a shadow tinted with an RGBA color.
+ */
+void img_save_shadow_png(struct img *alpha, char *pathname,
+        const uint8_t color[4])
 {
-    size_t size = 3 * img->width * img->height;
-    uint8_t *bitmap = malloc(size);
+    uint8_t *bitmap = malloc(4 * (size_t) alpha->width * alpha->height);
 
-    for (int y = 0; y < img->height; y++) {
-        float *row = &img->pixels[img->stride * y];
-        uint8_t *out_row = &bitmap[3 * img->width * y];
-        for (int i = 0; i < 3 * img->width; i++) {
-            if (fast_gamma) {
-                out_row[i] = gamma_encode_fast(row[i]);
-            } else {
-                out_row[i] = gamma_encode(row[i]);
-            }
-        }
+    struct shadow_args args = { alpha, bitmap, color };
+    pool_for(thread_pool, alpha->height, encode_shadow_rows, &args);
+
+    stbi_write_png(pathname, alpha->width, alpha->height, 4, bitmap,
+            4 * alpha->width);
+    free(bitmap);
+}
+
+/**
+ * Set up encode parameters for the command line arguments, without
+ * unsharp masking.
+ */
+void encode_params_init(struct encode_params *params, struct arguments *args)
+{
+    *params = (struct encode_params) { args->fast_gamma };
+
+    if (args->adjust) {
+        params->adjust = &args->color_adjust;
     }
+}
 
-    return bitmap;
+/**
+ * Apply the morphological operation from the arguments, if any, to an
+ * image in place.
+ */
+void img_morph_args(struct img *img, struct img *tmp, struct arguments *args)
+{
+    if (args->morph != MORPH_NONE) {
+        img_morph(img, img, tmp, args->morph, args->morph_radius);
+    }
 }
 
 /**
- * Load an image from a file and convert to linear colors.
+ * Blur an image as requested by the command line arguments.
+ *
+ * Returns the image to encode, which is img itself unless the source is
+ * kept for unsharp masking, in which case it is blurred. params is set
+ * up with the matching encode parameters. Temporaries other than tmp
+ * and blurred are taken from scratch, which may be NULL.
  */
-void img_load(struct img *img, char *pathname, bool fast_gamma)
+struct img *img_blur_args(struct img *img, struct img *blurred, struct img *tmp,
+        struct arguments *args, struct encode_params *params,
+        struct scratch *scratch)
 {
-    int width, height, channels;
-    bool use_stdin = (strcmp(pathname, "-") == 0);
+    encode_params_init(params, args);
+    img_morph_args(img, tmp, args);
+
+    struct img *out = img;
+    if (args->unsharp) {
+        params->unsharp_src = img;
+        params->unsharp_amount = args->unsharp_amount;
+        params->unsharp_threshold = args->unsharp_threshold;
+        out = blurred;
+    }
 
-    uint8_t *bitmap;
-    if (use_stdin) {
-        bitmap = stbi_load_from_file(stdin, &width, &height, &channels, 3);
-    } else {
-        bitmap = stbi_load(pathname, &width, &height, &channels, 3);
+    if (args->guided) {
+        // blurred is free to use as the work image unless it is the output
+        if (out == img) {
+            img_guided(img, out, tmp, blurred, args->guided_radius,
+                    args->guided_eps);
+            return out;
+        }
+
+        struct img work;
+        img_init_scratch(&work, img->width, img->height, 2 * img->channels,
+                scratch);
+        img_guided(img, out, tmp, &work, args->guided_radius,
+                args->guided_eps);
+        img_put_scratch(&work, scratch);
+        return out;
     }
 
-    if (!bitmap) {
-        fmt_error_and_exit("could not load image from %s", pathname);
+    if (args->half_chroma) {
+        img_blur_half_chroma(img, out, tmp, args->engine, args->blur_passes,
+                args->blur_size, scratch);
+        return out;
     }
 
-    struct raw_image_format format = { FORMAT_RGB, width, height };
-    img_gamma_decode_bitmap(img, bitmap, &format, fast_gamma);
+    if (args->tilt_shift) {
+        img_blur_tilt_shift(img, out, tmp, args->blur_passes, &args->tilt,
+                scratch);
+        return out;
+    }
 
-    free(bitmap);
+    img_blur_engine(img, out, tmp, args->engine, args->blur_passes,
+            args->blur_size, scratch);
+    return out;
 }
 
-void img_load_raw(struct img *img, char *pathname,
-        struct raw_image_format *raw_fmt, bool fast_gamma)
+/*
+ * Number of rows a tile needs before and after its own rows for the blur
+ * of its own rows to be exact. Each pass needs the filter radius on both
+ * sides, and before the rows also up to one resync interval, since the
+ * running sum at a row depends on the rows since the last resync point.
+ */
+int tile_context_before(struct arguments *args)
 {
-    int pixel_size = pixel_format_size[raw_fmt->format];
-    size_t raw_img_size = pixel_size * raw_fmt->width * raw_fmt->height;
+    int p = (args->blur_size - 1) / 2;
+    return args->blur_passes * (p + resync_interval(args->blur_size) - 1);
+}
 
-    bool use_stdin = (strcmp(pathname, "-") == 0);
-    FILE *file = use_stdin ? stdin : fopen(pathname, "r");
+int tile_context_after(struct arguments *args)
+{
+    int p = (args->blur_size - 1) / 2;
+    return args->blur_passes * p;
+}
+
+char *tile_path(char *prefix, int index)
+{
+    size_t size = strlen(prefix) + 32;
+    char *path = malloc(size);
+    snprintf(path, size, "%s.%d.ppm", prefix, index);
+
+    return path;
+}
+
+/**
+ * Save a tile as a binary PPM file.
+ *
+ * The tile metadata is stored in a comment, which keeps the file
+ * readable by any image viewer.
+ */
+void tile_save(char *pathname, struct tile *tile, uint8_t *bitmap, int width,
+        int height)
+{
+    FILE *file = fopen(pathname, "wb");
     if (!file) {
         int errsv = errno;
-        char *err = strerror(errsv);
-        fmt_error_and_exit("cannot open '%s' (%s)", pathname, err);
+        fmt_error_and_exit("cannot open '%s' (%s)", pathname, strerror(errsv));
     }
 
-    uint8_t *bitmap = malloc(raw_img_size);
+    fprintf(file, "P6\n# fastblur-tile %d %d %d %d %d %d\n%d %d\n255\n",
+            tile->index, tile->count, tile->full_height, tile->y_begin,
+            tile->own_begin, tile->own_end, width, height);
 
-    size_t bytes_read = fread(bitmap, 1, raw_img_size, file);
-    if (bytes_read != raw_img_size) {
-        fmt_error_and_exit("unexpected eof before raw image end");
+    size_t size = 3 * (size_t) width * height;
+    if (fwrite(bitmap, 1, size, file) != size || fclose(file) != 0) {
+        fmt_error_and_exit("could not write tile to %s", pathname);
     }
+}
 
-    if (use_stdin) {
-        fclose(file);
+/**
+ * Load a tile saved with tile_save.
+ */
+uint8_t *tile_load(char *pathname, struct tile *tile, int *width, int *height)
+{
+    FILE *file = fopen(pathname, "rb");
+    if (!file) {
+        int errsv = errno;
+        fmt_error_and_exit("cannot open '%s' (%s)", pathname, strerror(errsv));
+    }
+
+    int fields = fscanf(file, "P6 # fastblur-tile %d %d %d %d %d %d",
+            &tile->index, &tile->count, &tile->full_height, &tile->y_begin,
+            &tile->own_begin, &tile->own_end);
+    fclose(file);
+
+    if (fields != 6) {
+        fmt_error_and_exit("%s is not a fastblur tile", pathname);
+    }
+
+    return bitmap_load(pathname, 3, width, height);
+}
+
+/**
+ * Cut an image into horizontal strips that can be blurred independently.
+ *
+ * Each tile includes the context rows needed to blur its own rows
+ * exactly with the current blur size and passes.
+ */
+void run_split(struct arguments *args)
+{
+    int width, height;
+    uint8_t *bitmap = bitmap_load(args->input_file, 3, &width, &height);
+
+    int count = args->split_count;
+    if (count > height) {
+        fmt_error_and_exit("cannot split %d rows into %d tiles", height, count);
+    }
+
+    int before = tile_context_before(args);
+    int after = tile_context_after(args);
+
+    for (int i = 0; i < count; i++) {
+        struct tile tile = { i, count, height };
+        tile.own_begin = (long) height * i / count;
+        tile.own_end = (long) height * (i + 1) / count;
+        tile.y_begin = MAX(0, tile.own_begin - before);
+        int y_end = MIN(height, tile.own_end + after);
+
+        char *path = tile_path(args->output_file, i);
+        tile_save(path, &tile, &bitmap[3 * (size_t) width * tile.y_begin],
+                width, y_end - tile.y_begin);
+        free(path);
     }
 
-    img_gamma_decode_bitmap(img, bitmap, raw_fmt, fast_gamma);
     free(bitmap);
 }
 
 /**
- * Gamma-encode an image and save it.
+ * Blur one tile written by run_split, keeping only its own rows.
  */
-void img_save_png(struct img *img, char *pathname, bool fast_gamma)
+void run_tile(struct arguments *args)
 {
-    uint8_t *bitmap = img_gamma_encode_to_bitmap(img, fast_gamma);
+    struct tile tile;
+    int width, height;
+    char *path = tile_path(args->input_file, args->tile_index);
+    uint8_t *bitmap = tile_load(path, &tile, &width, &height);
+    free(path);
+
+    int y_end = tile.y_begin + height;
+    bool enough_before = tile.y_begin == 0
+        || tile.own_begin - tile.y_begin >= tile_context_before(args);
+    bool enough_after = y_end == tile.full_height
+        || y_end - tile.own_end >= tile_context_after(args);
+    if (!enough_before || !enough_after) {
+        fmt_error_and_exit("tile has too little context for this blur, "
+                "split with the same blur options");
+    }
+
+    struct img img;
+    struct raw_image_format format = { FORMAT_RGB, width, height };
+    img_gamma_decode_bitmap(&img, bitmap, &format, args->fast_gamma);
+    img.y_origin = tile.y_begin;
+
+    struct img tmp;
+    struct img blurred;
+    img_init(&tmp, 0, 0, 3);
+    img_init(&blurred, 0, 0, 3);
+
+    struct encode_params params;
+    struct img *out = img_blur_args(&img, &blurred, &tmp, args, &params,
+            NULL);
+
+    int own_y = tile.own_begin - tile.y_begin;
+    int own_height = tile.own_end - tile.own_begin;
+    struct img own = img_crop(out, width, own_height, 0, own_y);
+    struct img own_src = img_crop(&img, width, own_height, 0, own_y);
+    if (params.unsharp_src) {
+        params.unsharp_src = &own_src;
+    }
+
+    // The own rows fit in the bitmap the tile was loaded into
+    img_gamma_encode_into(&own, bitmap, &params);
+
+    tile.y_begin = tile.own_begin;
+    path = tile_path(args->output_file, tile.index);
+    tile_save(path, &tile, bitmap, width, own_height);
+    free(path);
 
-    int stride = 3 * img->width;
-    stbi_write_png(pathname, img->width, img->height, 3, bitmap, stride);
     free(bitmap);
+    free(img.pixels);
+    free(tmp.pixels);
+    free(blurred.pixels);
 }
 
 /**
- * Transpose an image.
+ * Stitch the own rows of blurred tiles into the full image.
+ */
+void run_merge(struct arguments *args)
+{
+    uint8_t *bitmap = NULL;
+    int full_width = 0;
+    int count = 1;
+    int next_row = 0;
+
+    for (int i = 0; i < count; i++) {
+        struct tile tile;
+        int width, height;
+        char *path = tile_path(args->input_file, i);
+        uint8_t *tile_bitmap = tile_load(path, &tile, &width, &height);
+
+        if (i == 0) {
+            count = tile.count;
+            full_width = width;
+            bitmap = malloc(3 * (size_t) width * tile.full_height);
+        }
+
+        if (tile.index != i || tile.count != count || width != full_width
+                || tile.own_begin != next_row || tile.y_begin != tile.own_begin
+                || height != tile.own_end - tile.own_begin) {
+            fmt_error_and_exit("%s does not match the other blurred tiles", path);
+        }
+
+        size_t row_size = 3 * (size_t) width;
+        memcpy(&bitmap[row_size * tile.own_begin], tile_bitmap,
+                row_size * height);
+        next_row = tile.own_end;
+
+        free(tile_bitmap);
+        free(path);
+    }
+
+    stbi_write_png(args->output_file, full_width, next_row, 3, bitmap,
+            3 * full_width);
+    free(bitmap);
+}
+
+struct batch;
+
+struct batch_item {
+    struct batch *batch;
+    int index;
+    struct img img;
+    struct img blurred;
+    struct png_buffer png;
+    struct pool_task task;
+    long pixels;
+    double decode_seconds;
+    double encode_seconds;
+};
+
+/*
+ * Counters of a batch run for the --metrics file. Items record their
+ * own timings on the worker threads, which are added here by the thread
+ * running run_batch when the item is written.
+ */
+struct batch_metrics {
+    unsigned long images;
+    unsigned long long pixels;
+    unsigned long long bytes_read;
+    unsigned long long bytes_written;
+    unsigned long scratch_allocations;
+    struct histogram decode;
+    struct histogram blur;
+    struct histogram encode;
+    double start;
+    double last_update;
+    bool complete;
+};
+
+/*
+ * Files are read ahead and written behind with asynchronous I/O, so the
+ * threads only decode, blur and encode. All I/O is issued from the
+ * thread running run_batch.
+ */
+struct batch {
+    struct arguments *args;
+    struct aio *aio;
+    struct aio_file *reads;
+    struct aio_file *writes;
+    struct pool_group decoded;
+    struct pool_group encoded[BATCH_WINDOWS];
+    struct img pack;
+    struct img tmp;
+    struct scratch *scratch;
+    struct batch_metrics metrics;
+};
+
+static char *batch_input_file(struct batch *batch, int index)
+{
+    return batch->args->files[2 * index];
+}
+
+static char *batch_output_file(struct batch *batch, int index)
+{
+    return batch->args->files[2 * index + 1];
+}
+
+static void batch_decode(void *arg)
+{
+    struct batch_item *item = arg;
+    struct batch *batch = item->batch;
+    struct arguments *args = batch->args;
+    struct aio_file *file = &batch->reads[item->index];
+    double start = now_sec();
+
+    int width, height;
+    uint8_t *bitmap = bitmap_load_memory(file->data, file->size,
+            batch_input_file(batch, item->index), 3, &width, &height);
+    free(file->data);
+    file->data = NULL;
+
+    struct raw_image_format format = { FORMAT_RGB, width, height };
+    img_init_scratch(&item->img, width, height, 3, batch->scratch);
+    img_gamma_decode_bitmap_into(&item->img, bitmap, &format,
+            args->fast_gamma);
+    free(bitmap);
+
+    if (args->crop_mode == CROP_FILL) {
+        img_resize_fill_scratch(&item->img, &args->geom, batch->scratch);
+    }
+
+    if (args->unsharp) {
+        img_init_scratch(&item->blurred, item->img.width, item->img.height,
+                3, batch->scratch);
+    }
+
+    item->pixels = (long) width * height;
+    item->decode_seconds = now_sec() - start;
+}
+
+/*
+ * The image an item is blurred into. The source is kept when it is
+ * needed for unsharp masking, otherwise the item is blurred in place.
+ */
+static struct img *batch_output(struct batch_item *item)
+{
+    return item->batch->args->unsharp ? &item->blurred : &item->img;
+}
+
+static void batch_encode(void *arg)
+{
+    struct batch_item *item = arg;
+    struct batch *batch = item->batch;
+    struct arguments *args = batch->args;
+    double start = now_sec();
+
+    struct encode_params params;
+    encode_params_init(&params, args);
+    if (args->unsharp) {
+        params.unsharp_src = &item->img;
+        params.unsharp_amount = args->unsharp_amount;
+        params.unsharp_threshold = args->unsharp_threshold;
+    }
+
+    item->png = img_encode_png(batch_output(item), &params, batch->scratch);
+
+    img_put_scratch(&item->img, batch->scratch);
+    img_put_scratch(&item->blurred, batch->scratch);
+    item->encode_seconds = now_sec() - start;
+}
+
+/*
+ * Blur a window of decoded images. Runs of same-sized images are packed
+ * into multi-channel images and blurred together.
+ */
+static void batch_blur(struct batch *batch, struct batch_item *items, int count)
+{
+    struct arguments *args = batch->args;
+    struct img *srcs[BATCH_LANES];
+    struct img *dsts[BATCH_LANES];
+
+    for (int i = 0; i < count; i++) {
+        img_morph_args(&items[i].img, &batch->tmp, args);
+    }
+
+    if (args->guided) {
+        // The pack buffer is free to use as the work image
+        for (int i = 0; i < count; i++) {
+            img_guided(&items[i].img, batch_output(&items[i]), &batch->tmp,
+                    &batch->pack, args->guided_radius, args->guided_eps);
+        }
+        return;
+    }
+
+    if (args->half_chroma) {
+        for (int i = 0; i < count; i++) {
+            img_blur_half_chroma(&items[i].img, batch_output(&items[i]),
+                    &batch->tmp, args->engine, args->blur_passes,
+                    args->blur_size, batch->scratch);
+        }
+        return;
+    }
+
+    if (args->tilt_shift) {
+        for (int i = 0; i < count; i++) {
+            img_blur_tilt_shift(&items[i].img, batch_output(&items[i]),
+                    &batch->tmp, args->blur_passes, &args->tilt,
+                    batch->scratch);
+        }
+        return;
+    }
+
+    for (int i = 0; i < count;) {
+        int w = items[i].img.width;
+        int h = items[i].img.height;
+        int lanes = MIN(BATCH_LANES, MAX(1, BATCH_PACK_PIXELS / (w * h)));
+
+        int k = 0;
+        while (i + k < count && k < lanes && items[i + k].img.width == w
+                && items[i + k].img.height == h) {
+            srcs[k] = &items[i + k].img;
+            dsts[k] = batch_output(&items[i + k]);
+            k++;
+        }
+
+        if (k == 1) {
+            img_blur_engine(srcs[0], dsts[0], &batch->tmp, args->engine,
+                    args->blur_passes, args->blur_size, batch->scratch);
+        } else {
+            img_pack(srcs, k, &batch->pack);
+            img_blur_engine(&batch->pack, &batch->pack, &batch->tmp,
+                    args->engine, args->blur_passes, args->blur_size,
+                    batch->scratch);
+            img_unpack(&batch->pack, dsts, k);
+        }
+
+        i += k;
+    }
+}
+
+static void batch_start_read(struct batch *batch, int index)
+{
+    char *pathname = batch_input_file(batch, index);
+    int error = aio_read_file(batch->aio, &batch->reads[index], pathname);
+    if (error) {
+        fmt_error_and_exit("cannot open '%s' (%s)", pathname, strerror(error));
+    }
+}
+
+static void batch_wait_read(struct batch *batch, int index)
+{
+    int error = aio_wait(batch->aio, &batch->reads[index]);
+    if (error) {
+        fmt_error_and_exit("could not read %s (%s)",
+                batch_input_file(batch, index), strerror(error));
+    }
+
+    batch->metrics.bytes_read += batch->reads[index].size;
+}
+
+static void batch_start_write(struct batch *batch, struct batch_item *item)
+{
+    struct batch_metrics *metrics = &batch->metrics;
+    metrics->images++;
+    metrics->pixels += item->pixels;
+    metrics->bytes_written += item->png.size;
+    histogram_observe(&metrics->decode, item->decode_seconds);
+    histogram_observe(&metrics->encode, item->encode_seconds);
+
+    char *pathname = batch_output_file(batch, item->index);
+    int error = aio_write_file(batch->aio, &batch->writes[item->index],
+            pathname, item->png.data, item->png.size);
+    if (error) {
+        fmt_error_and_exit("cannot open '%s' (%s)", pathname, strerror(error));
+    }
+}
+
+static void batch_wait_write(struct batch *batch, int index)
+{
+    struct aio_file *file = &batch->writes[index];
+    int error = aio_wait(batch->aio, file);
+    if (error) {
+        fmt_error_and_exit("could not write %s (%s)",
+                batch_output_file(batch, index), strerror(error));
+    }
+
+    free(file->data);
+    file->data = NULL;
+}
+
+static void batch_write_metrics(FILE *file, void *ctx)
+{
+    struct batch_metrics *metrics = ctx;
+    const char *stage = "fastblur_batch_stage_duration_seconds";
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    metrics_write_header(file, "fastblur_batch_images_total", "counter",
+            "Images blurred and encoded.");
+    metrics_write_value(file, "fastblur_batch_images_total", NULL,
+            metrics->images);
+    metrics_write_header(file, "fastblur_batch_pixels_total", "counter",
+            "Pixels of the decoded source images.");
+    metrics_write_value(file, "fastblur_batch_pixels_total", NULL,
+            metrics->pixels);
+    metrics_write_header(file, "fastblur_batch_read_bytes_total", "counter",
+            "Bytes read from source files.");
+    metrics_write_value(file, "fastblur_batch_read_bytes_total", NULL,
+            metrics->bytes_read);
+    metrics_write_header(file, "fastblur_batch_written_bytes_total", "counter",
+            "Bytes of encoded images written.");
+    metrics_write_value(file, "fastblur_batch_written_bytes_total", NULL,
+            metrics->bytes_written);
+    metrics_write_header(file, "fastblur_batch_scratch_allocations_total",
+            "counter", "Buffers allocated for images and temporaries. "
+            "Constant once the run has warmed up.");
+    metrics_write_value(file, "fastblur_batch_scratch_allocations_total", NULL,
+            metrics->scratch_allocations);
+
+    metrics_write_header(file, stage, "histogram", "Duration of each stage, "
+            "per image for decode and encode and per window for blur.");
+    metrics_write_histogram(file, stage, "stage=\"decode\"", &metrics->decode);
+    metrics_write_histogram(file, stage, "stage=\"blur\"", &metrics->blur);
+    metrics_write_histogram(file, stage, "stage=\"encode\"", &metrics->encode);
+
+    metrics_write_header(file, "fastblur_batch_duration_seconds", "gauge",
+            "Time since the batch run started.");
+    metrics_write_value(file, "fastblur_batch_duration_seconds", NULL,
+            now_sec() - metrics->start);
+    metrics_write_header(file, "fastblur_batch_complete", "gauge",
+            "1 if the batch run has completed, 0 while it is running.");
+    metrics_write_value(file, "fastblur_batch_complete", NULL,
+            metrics->complete);
+    metrics_write_header(file, "fastblur_peak_resident_bytes", "gauge",
+            "Peak resident memory of the process.");
+    metrics_write_value(file, "fastblur_peak_resident_bytes", NULL,
+            1024.0 * usage.ru_maxrss);
+}
+
+/*
+ * Write the metrics file if there is one, at most every METRICS_INTERVAL
+ * seconds unless force is set.
+ */
+static void batch_update_metrics(struct batch *batch, bool force)
+{
+    char *pathname = batch->args->metrics_file;
+    struct batch_metrics *metrics = &batch->metrics;
+    if (!pathname)
+        return;
+
+    double now = now_sec();
+    if (!force && now - metrics->last_update < METRICS_INTERVAL)
+        return;
+    metrics->last_update = now;
+    metrics->scratch_allocations = scratch_allocations(batch->scratch);
+
+    int error = metrics_write_file(pathname, batch_write_metrics, metrics);
+    if (error) {
+        fmt_error_and_exit("could not write %s (%s)", pathname,
+                strerror(error));
+    }
+}
+
+/**
+ * Blur many images, given as pairs of source and destination files.
+ *
+ * Images are processed in windows of BATCH_LANES. While one window is
+ * blurred, the next window is decoded and the previous one encoded on
+ * the thread pool, each in its own set of buffers. Input files are read
+ * BATCH_PREFETCH windows ahead, and outputs are written in the
+ * background.
+ */
+void run_batch(struct arguments *args)
+{
+    int n_images = args->n_files / 2;
+    struct batch batch = { args };
+    struct batch_item items[BATCH_WINDOWS][BATCH_LANES];
+
+    batch.aio = aio_create(2 * (BATCH_PREFETCH + 2) * BATCH_LANES);
+    batch.reads = calloc(n_images, sizeof(struct aio_file));
+    batch.writes = calloc(n_images, sizeof(struct aio_file));
+    img_init(&batch.pack, 0, 0, 3);
+    img_init(&batch.tmp, 0, 0, 3);
+    batch.scratch = scratch_create(BATCH_SCRATCH_BUFFERS);
+
+    double start = now_sec();
+    batch.metrics.start = start;
+    batch_update_metrics(&batch, true);
+
+    int n_windows = (n_images + BATCH_LANES - 1) / BATCH_LANES;
+    int n_read = 0;
+    int n_written = 0;
+    for (int w = 0; w < n_windows + BATCH_WINDOWS; w++) {
+        int read_end = MIN(n_images, (w + 1 + BATCH_PREFETCH) * BATCH_LANES);
+        for (; n_read < read_end; n_read++) {
+            batch_start_read(&batch, n_read);
+        }
+
+        // Window w - 3 shares buffers with window w. Once it is encoded,
+        // write it, after reclaiming the outputs of window w - 5 and
+        // earlier, which leaves the writes of windows w - 4 and w - 3 in
+        // flight. Window w - 2 keeps encoding while window w - 1 is
+        // blurred below.
+        int done = w - BATCH_WINDOWS;
+        pool_wait(thread_pool, &batch.encoded[w % BATCH_WINDOWS]);
+        if (done >= 0 && done < n_windows) {
+            struct batch_item *window = items[w % BATCH_WINDOWS];
+            int count = MIN(BATCH_LANES, n_images - done * BATCH_LANES);
+            for (; n_written < (done - 1) * BATCH_LANES; n_written++) {
+                batch_wait_write(&batch, n_written);
+            }
+            for (int i = 0; i < count; i++) {
+                batch_start_write(&batch, &window[i]);
+            }
+            batch_update_metrics(&batch, false);
+        }
+
+        // Decode window w
+        if (w < n_windows) {
+            struct batch_item *window = items[w % BATCH_WINDOWS];
+            int count = MIN(BATCH_LANES, n_images - w * BATCH_LANES);
+
+            for (int i = 0; i < count; i++) {
+                int index = w * BATCH_LANES + i;
+                batch_wait_read(&batch, index);
+
+                window[i] = (struct batch_item) { &batch, index };
+                window[i].img.pixels = NULL;
+                window[i].blurred.pixels = NULL;
+                pool_submit(thread_pool, &batch.decoded, &window[i].task,
+                        batch_decode, &window[i]);
+            }
+        }
+
+        // Blur and encode window w - 1 while window w decodes
+        if (w >= 1 && w - 1 < n_windows) {
+            int slot = (w - 1) % BATCH_WINDOWS;
+            struct batch_item *window = items[slot];
+            int count = MIN(BATCH_LANES, n_images - (w - 1) * BATCH_LANES);
+
+            double blur_start = now_sec();
+            batch_blur(&batch, window, count);
+            histogram_observe(&batch.metrics.blur, now_sec() - blur_start);
+
+            for (int i = 0; i < count; i++) {
+                pool_submit(thread_pool, &batch.encoded[slot], &window[i].task,
+                        batch_encode, &window[i]);
+            }
+        }
+
+        pool_wait(thread_pool, &batch.decoded);
+    }
+
+    for (; n_written < n_images; n_written++) {
+        batch_wait_write(&batch, n_written);
+    }
+
+    batch.metrics.complete = true;
+    batch_update_metrics(&batch, true);
+
+    double elapsed = now_sec() - start;
+    fprintf(stderr, "%s: %d images in %.2fs (%.1f images/s, %s)\n",
+            program_name, n_images, elapsed, n_images / elapsed,
+            aio_is_async(batch.aio) ? "io_uring" : "blocking I/O");
+
+    aio_destroy(batch.aio);
+    free(batch.reads);
+    free(batch.writes);
+    free(batch.pack.pixels);
+    free(batch.tmp.pixels);
+    scratch_destroy(batch.scratch);
+}
+
+/**
+ * Blur the alpha channel of an image into a tinted drop shadow.
  *
- * Since images are stored in row-major order, operations working in
- * row-major order perform about 3x better than operations that work
- * in column-major order. If many column-major operations are performed
- * consecutively it may be faster to transpose the image before and
- * after.
+ * Only one channel is blurred and there is no gamma conversion, which
+ * makes this several times cheaper than a full color blur.
+ */
+void run_shadow(struct arguments *args)
+{
+    struct img alpha;
+    img_load_alpha(&alpha, args->input_file,
+            args->raw_image ? &args->raw_fmt : NULL);
+
+    if (args->crop_mode == CROP_FILL) {
+        img_resize_fill(&alpha, &args->geom);
+    }
+
+    struct img tmp;
+    img_init(&tmp, alpha.width, alpha.height, 1);
+
+    img_morph_args(&alpha, &tmp, args);
+    img_blur_engine(&alpha, &alpha, &tmp, args->engine, args->blur_passes,
+            args->blur_size, NULL);
+    img_save_shadow_png(&alpha, args->output_file, args->shadow_color);
+
+    free(alpha.pixels);
+    free(tmp.pixels);
+}
+
+/*
+ * One output of a multi-geometry run. Variants are encoded in the
+ * background while the next one is resized and blurred.
+ */
+struct variant {
+    struct arguments args;
+    struct img img;
+    struct img blurred;
+    struct img *out;
+    struct encode_params params;
+    char *output_file;
+    struct pool_task task;
+};
+
+/*
+ * Scale a blur size, given for the first geometry, to another geometry
+ * by the ratio of their diagonals, rounded to the nearest odd size.
+ */
+unsigned scaled_blur_size(unsigned size, struct geometry *ref,
+        struct geometry *geom)
+{
+    double scale = sqrt(((double) geom->width * geom->width
+                + (double) geom->height * geom->height)
+            / ((double) ref->width * ref->width
+                + (double) ref->height * ref->height));
+
+    long half = lround((size * scale - 1.0) / 2.0);
+    return 2 * MAX(half, 0) + 1;
+}
+
+static void variant_encode(void *arg)
+{
+    struct variant *variant = arg;
+
+    img_save_png(variant->out, variant->output_file, &variant->params,
+            NULL);
+
+    free(variant->img.pixels);
+    free(variant->blurred.pixels);
+}
+
+/**
+ * Write the source image resized to each of the requested geometries and
+ * blurred, decoding it only once. Each variant is resized from the
+ * decoded image, with the blur size scaled to its geometry.
+ */
+void run_variants(struct arguments *args, struct img *src)
+{
+    struct variant *variants = calloc(args->n_geoms, sizeof(*variants));
+    struct pool_group encoded = { 0 };
+
+    struct img tmp;
+    img_init(&tmp, 0, 0, src->channels);
+
+    for (int i = 0; i < args->n_geoms; i++) {
+        struct variant *variant = &variants[i];
+        struct geometry *geom = &args->geoms[i];
+
+        // Kept in the variant, since params may point into it until the
+        // encode is done
+        variant->args = *args;
+        variant->args.blur_size = scaled_blur_size(args->blur_size,
+                &args->geoms[0], geom);
+        variant->args.tilt.max_size = scaled_blur_size(args->tilt.max_size,
+                &args->geoms[0], geom);
+
+        TIMER_START(resize);
+        variant->img = img_fill(src, geom);
+        TIMER_END(resize);
+
+        img_init(&variant->blurred, 0, 0, src->channels);
+        variant->out = img_blur_args(&variant->img, &variant->blurred, &tmp,
+                &variant->args, &variant->params, NULL);
+        variant->output_file = args->files[i + 1];
+
+        pool_submit(thread_pool, &encoded, &variant->task, variant_encode,
+                variant);
+    }
+
+    TIMER_START(encode);
+    pool_wait(thread_pool, &encoded);
+    TIMER_END(encode);
+
+    free(tmp.pixels);
+    free(variants);
+}
+
+/*
+ * Temporal moving average over the last frames of a stream. As in the
+ * spatial filter, a running sum is updated by adding the newest frame and
+ * subtracting the one leaving the window, so the cost per pixel does not
+ * depend on the window length. The sum is recomputed from the frames in
+ * the window every resync interval to bound the rounding error.
  */
-void img_transpose(struct img *src, struct img *dst)
+struct temporal {
+    int length;
+    int count;
+    int next;
+    int since_resync;
+    struct img *ring;
+    struct img sum;
+    struct img mean;
+};
+
+struct temporal_args {
+    struct temporal *temporal;
+    struct img *frame;
+    struct img *old;
+    bool resync;
+};
+
+void temporal_init(struct temporal *t, int length)
 {
-    img_set_size(dst, src->height, src->width);
+    t->length = length;
+    t->count = 0;
+    t->next = 0;
+    t->since_resync = 0;
+    t->ring = malloc(length * sizeof(struct img));
+    for (int i = 0; i < length; i++) {
+        img_init(&t->ring[i], 0, 0, 3);
+    }
+    img_init(&t->sum, 0, 0, 3);
+    img_init(&t->mean, 0, 0, 3);
+}
 
-    size_t src_w = src->width;
-    size_t src_h = src->height;
+void temporal_free(struct temporal *t)
+{
+    for (int i = 0; i < t->length; i++) {
+        free(t->ring[i].pixels);
+    }
+    free(t->ring);
+    free(t->sum.pixels);
+    free(t->mean.pixels);
+}
 
-    for (size_t y = 0; y < src_h; y++) {
-        for (size_t x = 0; x < src_w; x++) {
-            for (size_t c = 0; c < 3; c++) {
-                dst->pixels[IDX(src_h, y, x, 3) + c]
-                    = src->pixels[IDX(src_w, x, y, 3) + c];
+static void temporal_rows(void *ctx, int y0, int y1)
+{
+    struct temporal_args *args = ctx;
+    struct temporal *t = args->temporal;
+    int row_size = t->sum.channels * t->sum.width;
+    float a = 1.0f / t->count;
+
+    for (int y = y0; y < y1; y++) {
+        float *sum = &t->sum.pixels[t->sum.stride * y];
+        float *mean = &t->mean.pixels[t->mean.stride * y];
+        float *in = &args->frame->pixels[args->frame->stride * y];
+
+        if (args->resync) {
+            memcpy(sum, in, sizeof(float) * row_size);
+            for (int k = 0; k < t->count; k++) {
+                float *row = &t->ring[k].pixels[t->ring[k].stride * y];
+                if (row == in)
+                    continue;
+                for (int i = 0; i < row_size; i++) {
+                    sum[i] += row[i];
+                }
+            }
+        } else if (args->old) {
+            float *out = &args->old->pixels[args->old->stride * y];
+            for (int i = 0; i < row_size; i++) {
+                sum[i] += in[i] - out[i];
             }
+        } else {
+            for (int i = 0; i < row_size; i++) {
+                sum[i] += in[i];
+            }
+        }
+
+        for (int i = 0; i < row_size; i++) {
+            mean[i] = a * sum[i];
         }
     }
 }
 
 /**
- * Creates a cropped view of an image.
+ * Add a frame to the temporal window and return the mean of the frames
+ * in it.
  *
- * The cropped image points to the same data, but has a changed width
- * and height, but not stride. The pointer points to the first pixel
- * in the cropped image.
+ * The frame is moved into the window. frame is left holding the buffer
+ * of the frame that left the window, for reuse.
  */
-struct img img_crop(struct img *src, int w, int h, int x, int y)
+struct img *temporal_push(struct temporal *t, struct img *frame)
+{
+    if (t->count == 0) {
+        img_set_size(&t->sum, frame->width, frame->height, frame->channels);
+        img_set_size(&t->mean, frame->width, frame->height, frame->channels);
+    }
+
+    bool full = t->count == t->length;
+    struct img *slot = &t->ring[t->next];
+    struct img old = *slot;
+    *slot = *frame;
+    *frame = old;
+
+    if (!full)
+        t->count++;
+    t->next = (t->next + 1) % t->length;
+
+    struct temporal_args args = { t, slot, full ? frame : NULL, false };
+    if (t->count == 1 || ++t->since_resync >= resync_interval(t->length)) {
+        args.resync = true;
+        t->since_resync = 0;
+    }
+
+    pool_for(thread_pool, t->sum.height, temporal_rows, &args);
+
+    return &t->mean;
+}
+
+static FILE *stream_open(char *pathname, const char *mode, FILE *std)
 {
-    return (struct img) { w, h, src->stride, false, 0,
-            &src->pixels[y * src->stride + 3 * x] };
+    if (strcmp(pathname, "-") == 0)
+        return std;
+
+    FILE *file = fopen(pathname, mode);
+    if (!file) {
+        int errsv = errno;
+        char *err = strerror(errsv);
+        fmt_error_and_exit("cannot open '%s' (%s)", pathname, err);
+    }
+
+    return file;
 }
 
 /**
- * Perform nearest neigbor scaling.
+ * Blur a stream of raw frames, such as video piped from another program.
+ *
+ * Frames in the raw input format are read from the source until it ends
+ * and written to the destination as raw 8-bit RGB frames. With a
+ * temporal window, each output frame is the mean of the last frames,
+ * blurred spatially.
+ *
+ * Frame buffers come from a scratch pool, and the blur kernels keep their
+ * row buffers per thread, so once the temporal window has filled up no
+ * frame allocates memory. Debug builds check this on one thread. With
+ * more, which worker first needs a larger row buffer depends on
+ * scheduling.
  */
-struct img img_interp_nearest(struct img *src, int width, int height)
+void run_stream(struct arguments *args)
 {
-    const float dst_width_rcp = 1.0f / width;
-    const float dst_height_rcp = 1.0f / height;
+    struct raw_image_format *fmt = &args->raw_fmt;
+    size_t frame_size = (size_t) pixel_format_size[fmt->format]
+        * fmt->width * fmt->height;
+
+    FILE *in = stream_open(args->input_file, "r", stdin);
+    FILE *out = stream_open(args->output_file, "w", stdout);
+
+    uint8_t *bitmap = malloc(frame_size);
+    struct scratch *scratch = scratch_create(STREAM_SCRATCH_BUFFERS);
+
+    struct img frame, blurred, tmp;
+    img_init(&blurred, 0, 0, 3);
+    img_init(&tmp, 0, 0, 3);
+
+    struct temporal temporal;
+    temporal_init(&temporal, args->temporal);
+
+    double start = now_sec();
+    int frames = 0;
+#ifdef DEBUG
+    unsigned long warm_allocations = 0;
+#endif
+
+    for (;;) {
+        size_t bytes_read = fread(bitmap, 1, frame_size, in);
+        if (bytes_read == 0 && feof(in))
+            break;
+        if (bytes_read != frame_size)
+            fmt_error_and_exit("unexpected eof before raw frame end");
+
+        img_init_scratch(&frame, fmt->width, fmt->height, 3, scratch);
+        img_gamma_decode_bitmap_into(&frame, bitmap, fmt, args->fast_gamma);
+
+        if (args->crop_mode == CROP_FILL) {
+            img_resize_fill_scratch(&frame, &args->geom, scratch);
+        }
+
+        struct img *img = &frame;
+        if (args->temporal > 1) {
+            img = temporal_push(&temporal, &frame);
+        }
 
-    struct img dst;
-    img_init(&dst, width, height);
+        struct encode_params params;
+        struct img *result = img_blur_args(img, &blurred, &tmp, args, &params,
+                scratch);
 
-    for (int y = 0; y < dst.height; y++) {
-        float (*dst_row)[3] = (float (*)[3]) &dst.pixels[dst.stride * y];
+        size_t capacity;
+        size_t size = (size_t) result->channels * result->width
+            * result->height;
+        uint8_t *encoded = scratch_get(scratch, size, &capacity);
+        img_gamma_encode_into(result, encoded, &params);
 
-        int y_src = y * src->height * dst_height_rcp + 0.5;
-        float (*src_row)[3] = (float (*)[3]) &src->pixels[src->stride * y_src];
+        if (fwrite(encoded, 1, size, out) != size) {
+            int errsv = errno;
+            fmt_error_and_exit("cannot write '%s' (%s)", args->output_file,
+                    strerror(errsv));
+        }
 
-        for (int x = 0; x < dst.width; x++) {
-            int x_src = x * src->width * dst_width_rcp + 0.5;
+        scratch_put(scratch, encoded, capacity);
+        img_put_scratch(&frame, scratch);
+        frames++;
 
-            for (int c = 0; c < 3; c++) {
-                dst_row[x][c] = src_row[x_src][c];
-            }
+#ifdef DEBUG
+        // The window holds args->temporal buffers and the next frame one
+        if (frames <= args->temporal + 1) {
+            warm_allocations = alloc_count();
+        } else if (pool_threads(thread_pool) == 1) {
+            assert(alloc_count() == warm_allocations);
         }
+#endif
     }
 
-    return dst;
-}
+    if (fflush(out) != 0) {
+        int errsv = errno;
+        fmt_error_and_exit("cannot write '%s' (%s)", args->output_file,
+                strerror(errsv));
+    }
 
-void img_box2x2(struct img *src, struct img *dst)
-{
-    img_set_size(dst, src->width / 2, src->height / 2);
-    for (int y = 0; y < dst->height; y++) {
-        float (*dst_row)[3] = (float (*)[3]) &dst->pixels[dst->stride * y];
-        float (*src_row)[3] = (float (*)[3]) &src->pixels[src->stride * y * 2];
-        float (*src_row2)[3] = (float (*)[3]) &src->pixels[src->stride * y * 2 + 1];
+    double elapsed = now_sec() - start;
+    fprintf(stderr, "%s: %d frames in %.2fs (%.1f frames/s)\n", program_name,
+            frames, elapsed, frames / elapsed);
 
-        for (int x = 0; x < dst->height; x++) {
-            for (int c = 0; c < 3; c++) {
-                float sum = 0.0f;
-                sum += src_row[2 * x][c];
-                sum += src_row[2 * x + 1][c];
-                sum += src_row2[2 * x][c];
-                sum += src_row2[2 * x + 1][c];
-                dst_row[x][c] = 0.25f * sum;
-            }
-        }
-    }
+    if (in != stdin)
+        fclose(in);
+    if (out != stdout)
+        fclose(out);
+
+    temporal_free(&temporal);
+    scratch_destroy(scratch);
+    free(bitmap);
+    free(blurred.pixels);
+    free(tmp.pixels);
 }
 
-void img_decimate(struct img *img, int n)
+/**
+ * Read a whole file, or standard input if pathname is "-".
+ */
+uint8_t *file_read_all(char *pathname, size_t *size)
 {
-    struct img tmp;
-    tmp.pixels = NULL;
-    struct img *dst = &tmp;
-    struct img *src = img;
-
+    FILE *file = stream_open(pathname, "r", stdin);
+
+    size_t capacity = 1 << 16;
+    uint8_t *data = malloc(capacity);
+    *size = 0;
+
+    size_t bytes_read;
+    while ((bytes_read = fread(&data[*size], 1, capacity - *size, file)) > 0) {
+        *size += bytes_read;
+        if (*size == capacity) {
+            capacity *= 2;
+            data = realloc(data, capacity);
+        }
+    }
 
-    for (int i = 0; i < n; i++) {
-        img_box2x2(src, dst);
-        PTR_SWAP(src, dst);
+    if (ferror(file)) {
+        int errsv = errno;
+        fmt_error_and_exit("cannot read '%s' (%s)", pathname, strerror(errsv));
     }
 
-    free(dst->pixels);
-    *img = *src;
+    if (file != stdin)
+        fclose(file);
+
+    return data;
 }
 
-void img_resize_fill(struct img *img, struct geometry *geom)
+/*
+ * Check that a frame file pattern has exactly one conversion, %d with an
+ * optional zero padded width.
+ */
+bool frame_pattern_valid(char *pattern)
 {
-    float crop_aspect_ratio = (float) geom->width / geom->height;
-    float img_aspect_ratio = (float) img->width / img->height;
+    int conversions = 0;
+    for (char *p = pattern; *p; p++) {
+        if (*p != '%')
+            continue;
+
+        p++;
+        if (*p == '0')
+            p++;
+        while (*p >= '0' && *p <= '9')
+            p++;
+        if (*p != 'd')
+            return false;
+        conversions++;
+    }
 
-    int crop_w = img->width;
-    int crop_h = img->height;
-    int crop_x = 0;
-    int crop_y = 0;
+    return conversions == 1;
+}
 
-    if (crop_aspect_ratio > img_aspect_ratio) {
-        crop_h = (int) (img->width / crop_aspect_ratio + 0.5);
-        crop_y = (int) (geom->anchor * (img->height - crop_h) + 0.5);
-    } else {
-        crop_w = (int) (img->height * crop_aspect_ratio + 0.5);
-        crop_x = (int) (geom->anchor * (img->width - crop_w) + 0.5);
+struct frame_job {
+    struct arguments *args;
+    struct scratch *scratch;
+    uint8_t *bitmap;
+    struct raw_image_format format;
+    char *output_file;
+    uint8_t *encoded;
+    size_t encoded_size;
+    struct pool_task task;
+};
+
+/*
+ * Blur one frame of an animation. Frames are independent, so each one is
+ * a task of its own, and the rows of each frame are in turn spread over
+ * the threads that are idle.
+ */
+static void frame_blur(void *arg)
+{
+    struct frame_job *job = arg;
+    struct arguments *args = job->args;
+    struct scratch *scratch = job->scratch;
+    int width = job->format.width;
+    int height = job->format.height;
+
+    struct img img, blurred, tmp;
+    img_init_scratch(&img, width, height, 3, scratch);
+    img_gamma_decode_bitmap_into(&img, job->bitmap, &job->format,
+            args->fast_gamma);
+
+    if (args->crop_mode == CROP_FILL) {
+        img_resize_fill_scratch(&img, &args->geom, scratch);
+        width = img.width;
+        height = img.height;
     }
 
-    float scale_factor = (float) crop_w / (float) geom->width;
+    img_init_scratch(&blurred, width, height, 3, scratch);
+    img_init_scratch(&tmp, width, height, 3, scratch);
 
-    struct img cropped = img_crop(img, crop_w, crop_h, crop_x, crop_y);
+    struct encode_params params;
+    struct img *out = img_blur_args(&img, &blurred, &tmp, args, &params,
+            scratch);
 
-    struct img resized = img_interp_nearest(&cropped, geom->width, geom->height);
+    if (job->output_file) {
+        img_save_png(out, job->output_file, &params, scratch);
+    } else {
+        // The frame is decoded, so its source bitmap can take the output
+        // unless the frame was resized to more pixels
+        size_t size = (size_t) out->channels * out->width * out->height;
+        size_t frame_size = (size_t) 3 * job->format.width
+            * job->format.height;
+        job->encoded = size <= frame_size ? job->bitmap : malloc(size);
+        job->encoded_size = size;
+        img_gamma_encode_into(out, job->encoded, &params);
+    }
 
-    free(img->pixels);
-    *img = resized;
+    img_put_scratch(&img, scratch);
+    img_put_scratch(&blurred, scratch);
+    img_put_scratch(&tmp, scratch);
 }
 
 /**
- * Apply a recursive moving average filter horizontally.
+ * Blur every frame of an animated GIF.
  *
- * The recursive implementation is O(h * (w + n)) instead of
- * O(w * w * n) for convolution. This improves performance drastically,
- * especially for large values of n.
+ * If the destination is a pattern such as out%03d.png, each frame is
+ * written to its own PNG file. Otherwise the frames are written to it as
+ * raw 8-bit RGB frames. The frame delays are listed on standard output,
+ * or standard error if the frames are written there.
  */
-void img_mov_avg_h(struct img *src, struct img *dst, int n)
+void run_frames(struct arguments *args)
 {
-    img_set_size(dst, src->width, src->height);
-
-    int w = src->width;
-    int h = src->height;
-
-    float a = 1.0f / n;
-    int p = (n - 1) / 2;
-    int q = p + 1;
-
-    for (int y = 0; y < h; y++) {
-        // Simplify indexing by casting to pointer to float[3]
-        float (*src_row)[3] = (float (*)[3]) &src->pixels[src->stride * y];
-        float (*dst_row)[3] = (float (*)[3]) &dst->pixels[dst->stride * y];
+    size_t size;
+    uint8_t *data = file_read_all(args->input_file, &size);
 
-        // Compute first value using convolution. Since the edges are
-        // clamped, the left half is just multiplication.
-        for (int c = 0; c < 3; c++) {
-            dst_row[0][c] = src_row[0][c] * q * a;
+    int width, height, count, file_channels;
+    int *delays = NULL;
+    uint8_t *bitmap = stbi_load_gif_from_memory(data, size, &delays, &width,
+            &height, &count, &file_channels, 3);
+    if (!bitmap) {
+        // Not a GIF, treat it as a single frame
+        bitmap = bitmap_load_memory(data, size, args->input_file, 3, &width,
+                &height);
+        count = 1;
+    }
+    free(data);
+
+    bool pattern = strchr(args->output_file, '%') != NULL;
+    size_t frame_size = (size_t) 3 * width * height;
+
+    double start = now_sec();
+
+    struct scratch *scratch = scratch_create(FRAME_SCRATCH_BUFFERS
+            * pool_threads(thread_pool));
+
+    struct frame_job *jobs = calloc(count, sizeof(*jobs));
+    struct pool_group blurred = { 0 };
+    for (int i = 0; i < count; i++) {
+        struct frame_job *job = &jobs[i];
+        job->args = args;
+        job->scratch = scratch;
+        job->bitmap = &bitmap[frame_size * i];
+        job->format = (struct raw_image_format) { FORMAT_RGB, width, height };
+        if (pattern) {
+            int length = snprintf(NULL, 0, args->output_file, i);
+            job->output_file = malloc(length + 1);
+            snprintf(job->output_file, length + 1, args->output_file, i);
         }
 
-        for (int x = 1; x < q; x++) {
-            for (int c = 0; c < 3; c++) {
-                dst_row[0][c] += a * src_row[x][c];
+        pool_submit(thread_pool, &blurred, &job->task, frame_blur, job);
+    }
+    pool_wait(thread_pool, &blurred);
+    scratch_destroy(scratch);
+
+    FILE *list = stdout;
+    if (!pattern) {
+        FILE *out = stream_open(args->output_file, "w", stdout);
+        if (out == stdout)
+            list = stderr;
+
+        for (int i = 0; i < count; i++) {
+            if (fwrite(jobs[i].encoded, 1, jobs[i].encoded_size, out)
+                    != jobs[i].encoded_size) {
+                int errsv = errno;
+                fmt_error_and_exit("cannot write '%s' (%s)",
+                        args->output_file, strerror(errsv));
             }
         }
 
-        // Calculate remaining pixels recursively.
-        // y[n] = x[n - p] + ... + x[n + p] <=>
-        // y[n] = y[n - 1] + x[n + p] - x[n - q]
-        for (int x = 1; x < w; x++) {
-            for (int c = 0; c < 3; c++) {
-                dst_row[x][c] = dst_row[x - 1][c]
-                    + a * src_row[MIN(x + p, w - 1)][c]
-                    - a * src_row[MAX(x - q, 0)][c];
-            }
+        if (out == stdout) {
+            fflush(out);
+        } else {
+            fclose(out);
+        }
+    }
+
+    double elapsed = now_sec() - start;
+
+    for (int i = 0; i < count; i++) {
+        fprintf(list, "%s %d\n", pattern ? jobs[i].output_file : "-",
+                delays ? delays[i] : 0);
+        free(jobs[i].output_file);
+        if (jobs[i].encoded != jobs[i].bitmap) {
+            free(jobs[i].encoded);
         }
     }
+
+    fprintf(stderr, "%s: %d frames in %.2fs (%.1f frames/s)\n", program_name,
+            count, elapsed, count / elapsed);
+
+    free(jobs);
+    stbi_image_free(bitmap);
+    stbi_image_free(delays);
 }
 
-/*
- * Apply a recursive moving average filter vertically.
+/**
+ * Write a blurred mipmap chain of the source image.
  *
- * The recursive implementation is O(h * (w + n)) instead of
- * O(w * w * n) for convolution. This improves performance drastically,
- * especially for large values of n.
+ * Each level has half the size of the previous one and is blurred by
+ * the same amount, in its own pixels, as the first. Levels are derived
+ * from the previous blurred level: the 2x2 box filter brings along
+ * a quarter of its variance plus that of the box itself, and a small
+ * blur adds the rest. Each level costs about a quarter of the previous
+ * one, so the whole chain costs about 4/3 of the first level.
  *
- * Due to images being stored in row-major order this is about 3x slower
- * than img_mov_avg_h.
+ * If the destination is a pattern such as out%d.png, each level is
+ * written to its own file. Otherwise the levels are packed into one
+ * image, with the first level on the left and the others stacked to
+ * its right.
  */
-void img_mov_avg_v(struct img *src, struct img *dst, int n)
+void run_mipchain(struct arguments *args)
 {
-    img_set_size(dst, src->width, src->height);
-
-    int w = src->width;
-    int h = src->height;
+    struct img src;
+    img_load(&src, args->input_file, args->fast_gamma);
 
-    float a = 1.0f / n;
-    int p = (n - 1) / 2;
-    int q = p + 1;
+    if (args->crop_mode == CROP_FILL) {
+        img_resize_fill(&src, &args->geom);
+    }
 
-    for (int x = 0; x < w; x++) {
-        float *src_col = src->pixels + 3 * x;
-        float *dst_col = dst->pixels + 3 * x;
+    int count = 1;
+    while ((src.width >> count) >= 1 && (src.height >> count) >= 1) {
+        count++;
+    }
 
-        // Compute first value using convolution. Since the edges are
-        // clamped, the left half is just multiplication.
-        for (int c = 0; c < 3; c++) {
-            dst_col[c] = src_col[c] * q * a;
+    struct img *levels = malloc(count * sizeof(struct img));
+    struct img tmp;
+    img_init(&tmp, 0, 0, 3);
+    img_init(&levels[0], 0, 0, 3);
+
+    struct encode_params params;
+    encode_params_init(&params, args);
+
+    // Per-axis variance of the blur at each level, and the variance the
+    // 2x2 box filter adds, in the pixels of the level it writes
+    int passes = args->blur_passes;
+    double variance = passes * ((double) args->blur_size * args->blur_size - 1)
+        / 12;
+    double inherited = 0.25 * (variance + 0.25);
+    int level_size = blur_size_for_variance(variance - inherited, passes);
+
+    img_morph_args(&src, &tmp, args);
+
+    TIMER_START(mipchain);
+    img_blur_engine(&src, &levels[0], &tmp, args->engine, passes,
+            args->blur_size, NULL);
+    for (int k = 1; k < count; k++) {
+        img_init(&levels[k], 0, 0, 3);
+        img_box2x2(&levels[k - 1], &levels[k]);
+        if (level_size > 1) {
+            img_blur_engine(&levels[k], &levels[k], &tmp, args->engine,
+                    passes, level_size, NULL);
+        }
+    }
+    TIMER_END(mipchain);
+
+    TIMER_START(encode);
+    if (strchr(args->output_file, '%')) {
+        for (int k = 0; k < count; k++) {
+            int length = snprintf(NULL, 0, args->output_file, k);
+            char *path = malloc(length + 1);
+            snprintf(path, length + 1, args->output_file, k);
+            img_save_png(&levels[k], path, &params, NULL);
+            free(path);
         }
+    } else {
+        struct img atlas;
+        int width = levels[0].width + (count > 1 ? levels[1].width : 0);
+        img_init(&atlas, width, levels[0].height, 3);
+        memset(atlas.pixels, 0, sizeof(float) * atlas.stride * atlas.height);
+
+        int x = 0;
+        int y = 0;
+        for (int k = 0; k < count; k++) {
+            struct img *level = &levels[k];
+            for (int row = 0; row < level->height; row++) {
+                memcpy(&atlas.pixels[atlas.stride * (y + row) + 3 * x],
+                        &level->pixels[level->stride * row],
+                        sizeof(float) * level->stride);
+            }
 
-        for (int y = 1; y < q; y++) {
-            for (int c = 0; c < 3; c++) {
-                dst_col[c] += a * src_col[y * src->stride + c];
+            if (k == 0) {
+                x = level->width;
+            } else {
+                y += level->height;
             }
         }
 
-        // Calculate remaining pixels recursively.
-        // y[n] = x[n - p] + ... + x[n + p] <=>
-        // y[n] = y[n - 1] + x[n + p] - x[n - q]
-        for (int y = 1; y < h; y++) {
+        img_save_png(&atlas, args->output_file, &params, NULL);
+        free(atlas.pixels);
+    }
+    TIMER_END(encode);
+
+    for (int k = 0; k < count; k++) {
+        free(levels[k].pixels);
+    }
+    free(levels);
+    free(tmp.pixels);
+    free(src.pixels);
+}
+
+/**
+ * Median filter the source image. Works on the 8-bit values as loaded,
+ * with no gamma conversion.
+ */
+void run_median(struct arguments *args)
+{
+    int width, height;
+    uint8_t *bitmap;
+    if (args->raw_image) {
+        struct raw_image_format *fmt = &args->raw_fmt;
+        uint8_t *raw = bitmap_load_raw(args->input_file, fmt);
+        width = fmt->width;
+        height = fmt->height;
+
+        int pixel_size = pixel_format_size[fmt->format];
+        const int *offset = pixel_format_rgb_offset[fmt->format];
+        size_t n_pixels = (size_t) width * height;
+        bitmap = malloc(3 * n_pixels);
+        for (size_t i = 0; i < n_pixels; i++) {
             for (int c = 0; c < 3; c++) {
-                dst_col[y * dst->stride + c] = dst_col[(y - 1) * dst->stride + c]
-                    + a * src_col[MIN(y + p, h - 1) * src->stride + c]
-                    - a * src_col[MAX(y - q, 0) * src->stride + c];
+                bitmap[3 * i + c] = raw[pixel_size * i + offset[c]];
             }
         }
+        free(raw);
+    } else {
+        bitmap = bitmap_load(args->input_file, 3, &width, &height);
     }
+
+    uint8_t *filtered = malloc((size_t) 3 * width * height);
+    bitmap_median(bitmap, filtered, width, height, 3, args->median_radius);
+
+    TIMER_START(encode);
+    stbi_write_png(args->output_file, width, height, 3, filtered, 3 * width);
+    TIMER_END(encode);
+
+    free(bitmap);
+    free(filtered);
 }
 
 int parse_geometry(char *str, struct geometry *geom)
@@ -572,6 +1869,34 @@ int parse_geometry(char *str, struct geometry *geom)
     return !(ptr == str);
 }
 
+/*
+ * Parse a comma separated list of geometries.
+ */
+int parse_geometry_list(char *str, struct arguments *arguments)
+{
+    char *list = strdup(str);
+    char *save;
+    int ok = 1;
+
+    arguments->n_geoms = 0;
+    for (char *item = strtok_r(list, ",", &save); item;
+            item = strtok_r(NULL, ",", &save)) {
+        arguments->geoms = realloc(arguments->geoms,
+                (arguments->n_geoms + 1) * sizeof(struct geometry));
+
+        struct geometry *geom = &arguments->geoms[arguments->n_geoms++];
+        *geom = (struct geometry) {-1, -1, 0.5};
+        if (!parse_geometry(item, geom) || geom->width < 1
+                || geom->height < 1) {
+            ok = 0;
+            break;
+        }
+    }
+
+    free(list);
+    return ok && arguments->n_geoms > 0;
+}
+
 int parse_raw_format(char *str, struct raw_image_format *raw_fmt)
 {
     char *ptr;
@@ -595,8 +1920,8 @@ int parse_raw_format(char *str, struct raw_image_format *raw_fmt)
     if (alpha_first)
         str++;
 
-    bool rgb = strncmp(str, "rgb", 3);
-    bool bgr = strncmp(str, "bgr", 3);
+    bool rgb = strncmp(str, "rgb", 3) == 0;
+    bool bgr = strncmp(str, "bgr", 3) == 0;
 
     if (!rgb && !bgr)
         return 0;
@@ -613,6 +1938,121 @@ int parse_raw_format(char *str, struct raw_image_format *raw_fmt)
     return 1;
 }
 
+int parse_unsharp(char *str, struct arguments *arguments)
+{
+    char *ptr;
+    arguments->unsharp_amount = strtof(str, &ptr);
+
+    if (ptr == str || arguments->unsharp_amount < 0.0f)
+        return 0;
+
+    str = ptr;
+    if (*str != ',')
+        return *str == '\0';
+
+    str++;
+    arguments->unsharp_threshold = strtof(str, &ptr);
+
+    return !(ptr == str || *ptr != '\0');
+}
+
+/**
+ * Parse a hex color of the form [#]RRGGBB[AA].
+ */
+int parse_color(char *str, uint8_t color[4])
+{
+    if (*str == '#')
+        str++;
+
+    size_t len = strlen(str);
+    if (len != 6 && len != 8)
+        return 0;
+
+    color[3] = 255;
+    for (size_t i = 0; i < len / 2; i++) {
+        char hex[3] = { str[2 * i], str[2 * i + 1], '\0' };
+        char *end;
+        color[i] = strtoul(hex, &end, 16);
+        if (*end != '\0')
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Parse a non-negative float option value.
+ */
+int parse_factor(char *str, float *value)
+{
+    char *end;
+    *value = strtof(str, &end);
+
+    return end != str && *end == '\0' && *value >= 0.0f;
+}
+
+int parse_guided(char *str, struct arguments *arguments)
+{
+    char *end;
+    arguments->guided_radius = strtol(str, &end, 10);
+    if (end == str || arguments->guided_radius < 1)
+        return 0;
+
+    arguments->guided_eps = 0.01f;
+    if (*end == '\0')
+        return 1;
+    if (*end != ',')
+        return 0;
+
+    str = end + 1;
+    arguments->guided_eps = strtof(str, &end);
+
+    return end != str && *end == '\0' && arguments->guided_eps > 0.0f;
+}
+
+int parse_tilt_shift(char *str, struct tilt_shift *tilt)
+{
+    char *end;
+    tilt->center = strtof(str, &end);
+    if (end == str || *end != ',' || tilt->center < 0.0f
+            || tilt->center > 1.0f)
+        return 0;
+
+    str = end + 1;
+    tilt->width = strtof(str, &end);
+    if (end == str || *end != ',' || tilt->width < 0.0f || tilt->width > 1.0f)
+        return 0;
+
+    str = end + 1;
+    tilt->max_size = strtol(str, &end, 10);
+
+    return end != str && *end == '\0' && tilt->max_size >= 1
+        && tilt->max_size % 2 == 1;
+}
+
+int parse_tint(char *str, struct color_adjust *adjust)
+{
+    char *color = strdup(str);
+    char *comma = strchr(color, ',');
+    int ok = 1;
+
+    adjust->tint_amount = 0.3f;
+    if (comma) {
+        *comma = '\0';
+        ok = parse_factor(comma + 1, &adjust->tint_amount)
+            && adjust->tint_amount <= 1.0f;
+    }
+
+    uint8_t rgba[4];
+    ok = ok && parse_color(color, rgba);
+    for (int c = 0; ok && c < 3; c++) {
+        adjust->tint[c] = powf(rgba[c] / 255.0f, GAMMA);
+    }
+
+    free(color);
+    return ok;
+}
+
 static error_t parse_opt(int key, char *arg, struct argp_state *state)
 {
     struct arguments *arguments = state->input;
@@ -644,9 +2084,10 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
             break;
         case 'r':
             arguments->crop_mode = CROP_FILL;
-            if (!parse_geometry(arg, &arguments->geom)) {
-                argp_error(state, "invalid geometry, format WxH@A.");
+            if (!parse_geometry_list(arg, arguments)) {
+                argp_error(state, "invalid geometry, format WxH@A[,...].");
             }
+            arguments->geom = arguments->geoms[0];
             break;
         case 0x100:
             if (!parse_raw_format(arg, &arguments->raw_fmt)) {
@@ -654,18 +2095,268 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
             }
             arguments->raw_image = true;
             break;
-        case ARGP_KEY_ARG:
-            if (state->arg_num == 0) {
-                arguments->input_file = arg;
-            } else if (state->arg_num == 1) {
-                arguments->output_file = arg;
+        case 'j':
+            {
+                char *end;
+                int threads = strtol(arg, &end, 10);
+                if (end == arg || threads < 1)
+                    argp_error(state, "invalid thread count, must be at least 1.");
+
+                arguments->threads = threads;
+            }
+            break;
+        case 0x101:
+            arguments->batch = true;
+            break;
+        case 0x102:
+            if (!parse_unsharp(arg, arguments)) {
+                argp_error(state, "invalid unsharp mask, format AMOUNT[,THRESHOLD].");
+            }
+            arguments->unsharp = true;
+            break;
+        case 0x107:
+            if (strcmp(arg, "box") == 0) {
+                arguments->engine = ENGINE_BOX;
+            } else if (strcmp(arg, "dual") == 0) {
+                arguments->engine = ENGINE_DUAL;
             } else {
-                argp_usage(state);
+                argp_error(state, "invalid engine, must be box or dual.");
+            }
+            break;
+        case 0x104:
+            {
+                char *end;
+                int count = strtol(arg, &end, 10);
+                if (end == arg || count < 1)
+                    argp_error(state, "invalid tile count, must be at least 1.");
+
+                arguments->split_count = count;
+            }
+            break;
+        case 0x105:
+            {
+                char *end;
+                int index = strtol(arg, &end, 10);
+                if (end == arg || index < 0)
+                    argp_error(state, "invalid tile index.");
+
+                arguments->tile_index = index;
+            }
+            break;
+        case 0x106:
+            arguments->merge = true;
+            break;
+        case 0x108:
+            arguments->stream = true;
+            break;
+        case 0x10d:
+            arguments->frames = true;
+            break;
+        case 0x10e:
+            arguments->mipchain = true;
+            break;
+        case 0x110:
+            {
+                char *end;
+                long radius = strtol(arg, &end, 10);
+                if (end == arg || radius < 1 || radius > MEDIAN_MAX_RADIUS)
+                    argp_error(state, "invalid radius, must be 1 to %d.",
+                            MEDIAN_MAX_RADIUS);
+
+                arguments->median_radius = radius;
+            }
+            break;
+        case 0x111:
+        case 0x112:
+        case 0x113:
+        case 0x114:
+            {
+                char *end;
+                int radius = strtol(arg, &end, 10);
+                if (end == arg || radius < 1)
+                    argp_error(state, "invalid radius, must be at least 1.");
+                if (arguments->morph != MORPH_NONE)
+                    argp_error(state, "only one of --dilate, --erode, --open and --close.");
+
+                arguments->morph = MORPH_DILATE + (key - 0x111);
+                arguments->morph_radius = radius;
+            }
+            break;
+        case 0x10f:
+            if (!parse_guided(arg, arguments)) {
+                argp_error(state, "invalid guided filter, format RADIUS[,EPS].");
+            }
+            arguments->guided = true;
+            break;
+        case 0x115:
+            arguments->half_chroma = true;
+            break;
+        case 0x116:
+            arguments->roofline = true;
+            break;
+        case 0x118:
+            if (!parse_tilt_shift(arg, &arguments->tilt)) {
+                argp_error(state, "invalid tilt-shift, format CENTER,WIDTH,MAXSIZE "
+                        "with fractions of the height and an odd size.");
+            }
+            arguments->tilt_shift = true;
+            break;
+        case 0x117:
+            arguments->metrics_file = arg;
+            break;
+        case 0x10a:
+            if (!parse_factor(arg, &arguments->color_adjust.brightness)) {
+                argp_error(state, "invalid brightness, must be at least 0.");
+            }
+            arguments->adjust = true;
+            break;
+        case 0x10b:
+            if (!parse_factor(arg, &arguments->color_adjust.saturation)) {
+                argp_error(state, "invalid saturation, must be at least 0.");
+            }
+            arguments->adjust = true;
+            break;
+        case 0x10c:
+            if (!parse_tint(arg, &arguments->color_adjust)) {
+                argp_error(state, "invalid tint, format #RRGGBB[,AMOUNT].");
+            }
+            arguments->adjust = true;
+            break;
+        case 0x109:
+            {
+                char *end;
+                int length = strtol(arg, &end, 10);
+                if (end == arg || length < 1)
+                    argp_error(state, "invalid frame count, must be at least 1.");
+
+                arguments->temporal = length;
             }
             break;
+        case 0x103:
+            if (!parse_color(arg, arguments->shadow_color)) {
+                argp_error(state, "invalid color, format #RRGGBB[AA].");
+            }
+            arguments->shadow = true;
+            break;
+        case ARGP_KEY_ARG:
+            arguments->files[arguments->n_files++] = arg;
+            break;
         case ARGP_KEY_END:
-            if (state->arg_num < 1)
+            if (arguments->roofline) {
+                if (state->arg_num != 0)
+                    argp_error(state, "--roofline takes no files.");
+                break;
+            }
+
+            if (arguments->batch) {
+                if (state->arg_num < 2 || state->arg_num % 2 != 0)
+                    argp_error(state, "batch mode takes pairs of SOURCE DEST.");
+                if (arguments->raw_image)
+                    argp_error(state, "batch mode does not support raw images.");
+                if (arguments->shadow)
+                    argp_error(state, "batch mode does not support shadows.");
+            } else if (arguments->n_geoms > 1) {
+                if (state->arg_num != 1 + arguments->n_geoms)
+                    argp_error(state, "multiple geometries take one DEST each.");
+                if (arguments->shadow)
+                    argp_error(state, "--shadow takes a single geometry.");
+            } else if (state->arg_num < 1 || state->arg_num > 2) {
                 argp_usage(state);
+            }
+
+            if (arguments->batch && arguments->n_geoms > 1)
+                argp_error(state, "batch mode takes a single geometry.");
+            if (arguments->metrics_file && !arguments->batch)
+                argp_error(state, "--metrics requires --batch.");
+
+            if (arguments->stream) {
+                if (!arguments->raw_image)
+                    argp_error(state, "--stream requires --raw.");
+                if (arguments->batch || arguments->shadow
+                        || arguments->n_geoms > 1)
+                    argp_error(state, "--stream only supports blur options.");
+                if (state->arg_num != 2)
+                    argp_usage(state);
+            } else if (arguments->temporal > 1) {
+                argp_error(state, "--temporal requires --stream.");
+            }
+
+            if (arguments->mipchain) {
+                if (arguments->batch || arguments->shadow
+                        || arguments->stream || arguments->frames
+                        || arguments->raw_image || arguments->unsharp
+                        || arguments->guided || arguments->half_chroma
+                        || arguments->tilt_shift || arguments->n_geoms > 1)
+                    argp_error(state, "--mipchain only supports blur options.");
+                if (state->arg_num != 2)
+                    argp_usage(state);
+                if (strchr(arguments->files[1], '%')
+                        && !frame_pattern_valid(arguments->files[1]))
+                    argp_error(state, "invalid level pattern, must contain one %%d.");
+            }
+
+            if (arguments->median_radius > 0) {
+                if (arguments->batch || arguments->shadow
+                        || arguments->stream || arguments->frames
+                        || arguments->mipchain || arguments->guided
+                        || arguments->half_chroma || arguments->tilt_shift
+                        || arguments->unsharp || arguments->adjust
+                        || arguments->morph != MORPH_NONE
+                        || arguments->crop_mode != CROP_NONE)
+                    argp_error(state, "--median does not take other filters.");
+                if (state->arg_num != 2)
+                    argp_usage(state);
+            }
+
+            if (arguments->frames) {
+                if (arguments->batch || arguments->shadow
+                        || arguments->stream || arguments->raw_image
+                        || arguments->n_geoms > 1)
+                    argp_error(state, "--frames only supports blur options.");
+                if (state->arg_num != 2)
+                    argp_usage(state);
+                if (strchr(arguments->files[1], '%')
+                        && !frame_pattern_valid(arguments->files[1]))
+                    argp_error(state, "invalid frame pattern, must contain one %%d.");
+            }
+
+            if (arguments->shadow && arguments->unsharp)
+                argp_error(state, "--shadow and --unsharp are exclusive.");
+            if (arguments->shadow && arguments->guided)
+                argp_error(state, "--shadow and --guided are exclusive.");
+            if (arguments->shadow && arguments->half_chroma)
+                argp_error(state, "--shadow and --half-chroma are exclusive.");
+            if (arguments->guided && arguments->half_chroma)
+                argp_error(state, "--guided and --half-chroma are exclusive.");
+            if (arguments->tilt_shift && (arguments->shadow
+                        || arguments->guided || arguments->half_chroma
+                        || arguments->engine != ENGINE_BOX))
+                argp_error(state, "--tilt-shift only supports the box engine "
+                        "and color blur options.");
+            if (arguments->shadow && arguments->adjust)
+                argp_error(state, "--shadow does not support color adjustments.");
+
+            {
+                int tiled = (arguments->split_count > 0)
+                    + (arguments->tile_index >= 0) + arguments->merge;
+                if (tiled > 1)
+                    argp_error(state, "--split, --tile and --merge are exclusive.");
+                if (tiled && (arguments->batch || arguments->shadow
+                            || arguments->stream || arguments->frames
+                            || arguments->mipchain || arguments->guided
+                            || arguments->half_chroma || arguments->tilt_shift
+                            || arguments->median_radius > 0
+                            || arguments->morph != MORPH_NONE
+                            || arguments->raw_image
+                            || arguments->crop_mode != CROP_NONE
+                            || arguments->engine != ENGINE_BOX))
+                    argp_error(state, "tiled mode only supports blur options.");
+                if (tiled && state->arg_num != 2)
+                    argp_usage(state);
+            }
+
+            arguments->input_file = arguments->files[0];
+            arguments->output_file = arguments->files[1];
             break;
         default:
             return ARGP_ERR_UNKNOWN;
@@ -683,90 +2374,197 @@ int main(int argc, char **argv)
         {"blur-size",   'z',   "SIZE",     0,
          "Use a moving average filter of length SIZE" },
         {"blur-passes", 'p',   "COUNT",    0, "Do COUNT filter passes" },
-        {"resize",      'r',   "GEOMETRY", 0,
-         "Resize the input image before blurring" },
+        {"resize",      'r',   "GEOMETRY[,...]", 0,
+         "Resize the input image before blurring, to one DEST per GEOMETRY" },
         {"raw",         0x100, "FORMAT",   0, "Read raw bitmap image" },
+        {"threads",     'j',   "COUNT",    0,
+         "Use COUNT threads (default: number of CPUs)" },
+        {"batch",       0x101, 0,          0,
+         "Blur many images, given as SOURCE DEST pairs" },
+        {"metrics",     0x117, "FILE",     0,
+         "Write Prometheus metrics of a batch run to FILE" },
+        {"unsharp",     0x102, "AMOUNT[,THRESHOLD]", 0,
+         "Sharpen using the blur as an unsharp mask" },
+        {"shadow",      0x103, "COLOR",    0,
+         "Blur only the alpha channel into a drop shadow of COLOR" },
+        {"mipchain",    0x10e, 0,          0,
+         "Write a blurred mipmap chain of SOURCE" },
+        {"frames",      0x10d, 0,          0,
+         "Blur every frame of an animated GIF" },
+        {"stream",      0x108, 0,          0,
+         "Blur a stream of raw frames into raw RGB frames" },
+        {"temporal",    0x109, "COUNT",    0,
+         "Average the last COUNT frames of a stream" },
+        {"brightness",  0x10a, "FACTOR",   0,
+         "Multiply the blurred colors by FACTOR" },
+        {"saturation",  0x10b, "FACTOR",   0,
+         "Scale the saturation of the blurred colors by FACTOR" },
+        {"tint",        0x10c, "COLOR[,AMOUNT]", 0,
+         "Tint the blurred colors with COLOR (default amount 0.3)" },
+        {"guided",      0x10f, "RADIUS[,EPS]", 0,
+         "Smooth with an edge-preserving guided filter instead of blurring" },
+        {"half-chroma", 0x115, 0,          0,
+         "Blur chroma at half resolution, for about half the blur work" },
+        {"tilt-shift",  0x118, "CENTER,WIDTH,MAXSIZE", 0,
+         "Keep a band of rows sharp and blur more towards the top and bottom" },
+        {"median",      0x110, "RADIUS",   0,
+         "Median filter in a square of RADIUS instead of blurring" },
+        {"dilate",      0x111, "RADIUS",   0,
+         "Dilate with a square of RADIUS before blurring" },
+        {"erode",       0x112, "RADIUS",   0,
+         "Erode with a square of RADIUS before blurring" },
+        {"open",        0x113, "RADIUS",   0,
+         "Open (erode, then dilate) before blurring" },
+        {"close",       0x114, "RADIUS",   0,
+         "Close (dilate, then erode) before blurring" },
+        {"engine",      0x107, "ENGINE",   0,
+         "Blur with ENGINE: box (default) or dual" },
+        {"roofline",    0x116, 0,          0,
+         "Measure this host's roofline and how close each stage gets to it" },
+        {"split",       0x104, "COUNT",    0,
+         "Split SOURCE into COUNT tiles DEST.0.ppm ... for --tile" },
+        {"tile",        0x105, "INDEX",    0,
+         "Blur tile SOURCE.INDEX.ppm into DEST.INDEX.ppm" },
+        {"merge",       0x106, 0,          0,
+         "Merge blurred tiles SOURCE.0.ppm ... into DEST" },
         { 0 }
     };
 
     struct argp argp = {options, parse_opt, args_doc, doc};
 
     struct arguments arguments;
+    arguments.files = calloc(argc + 1, sizeof(char *));
+    arguments.metrics_file = NULL;
+    arguments.n_files = 0;
     arguments.fast_gamma = false;
     arguments.raw_image = false;
+    arguments.batch = false;
+    arguments.unsharp = false;
+    arguments.shadow = false;
+    arguments.stream = false;
+    arguments.temporal = 1;
+    arguments.adjust = false;
+    arguments.frames = false;
+    arguments.mipchain = false;
+    arguments.guided = false;
+    arguments.half_chroma = false;
+    arguments.tilt_shift = false;
+    arguments.roofline = false;
+    arguments.median_radius = 0;
+    arguments.morph = MORPH_NONE;
+    arguments.color_adjust = (struct color_adjust) { 1.0f, 1.0f,
+        { 1.0f, 1.0f, 1.0f }, 0.0f };
+    arguments.split_count = 0;
+    arguments.tile_index = -1;
+    arguments.merge = false;
+    arguments.unsharp_threshold = 0.0f;
+    arguments.threads = sysconf(_SC_NPROCESSORS_ONLN);
     arguments.blur_size = 31;
     arguments.blur_passes = 4;
+    arguments.engine = ENGINE_BOX;
     arguments.crop_mode = CROP_NONE;
     arguments.geom = (struct geometry) {-1, -1, 0.5};
+    arguments.geoms = NULL;
+    arguments.n_geoms = 0;
 
     argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
-    int passes = arguments.blur_passes;
-    int blur_size = arguments.blur_size;
-
     if (!arguments.fast_gamma)
         init_gamma_decode_lut();
 
-    struct img img;
-    if (arguments.raw_image) {
-        img_load_raw(&img, arguments.input_file, &arguments.raw_fmt, arguments.fast_gamma);
-    } else {
-        img_load(&img, arguments.input_file, arguments.fast_gamma);
-    }
-
-    if (arguments.crop_mode == CROP_FILL) {
-        TIMER_START(resize);
+    thread_pool = pool_create(arguments.threads);
 
-        float crop_aspect_ratio = (float) arguments.geom.width / arguments.geom.height;
-        float img_aspect_ratio = (float) img.width / img.height;
-
-        int crop_w = img.width;
-        int crop_h = img.height;
-        int crop_x = 0;
-        int crop_y = 0;
+    if (arguments.roofline) {
+        roofline_report(arguments.threads, arguments.blur_size,
+                arguments.fast_gamma);
+        pool_destroy(thread_pool);
+        return 0;
+    }
 
-        if (crop_aspect_ratio > img_aspect_ratio) {
-            crop_h = (int) (img.width / crop_aspect_ratio + 0.5);
-            crop_y = (int) (arguments.geom.anchor * (img.height - crop_h) + 0.5);
-        } else {
-            crop_w = (int) (img.height * crop_aspect_ratio + 0.5);
-            crop_x = (int) (arguments.geom.anchor * (img.width - crop_w) + 0.5);
-        }
+    if (arguments.batch) {
+        run_batch(&arguments);
+        pool_destroy(thread_pool);
+        return 0;
+    }
 
-        struct img cropped = img_crop(&img, crop_w, crop_h, crop_x, crop_y);
-        struct img resized = img_interp_nearest(&cropped,
-            arguments.geom.width, arguments.geom.height);
+    if (arguments.median_radius > 0) {
+        run_median(&arguments);
+        pool_destroy(thread_pool);
+        return 0;
+    }
 
-        free(img.pixels);
-        img = resized;
+    if (arguments.mipchain) {
+        run_mipchain(&arguments);
+        pool_destroy(thread_pool);
+        return 0;
+    }
 
-        TIMER_END(resize);
+    if (arguments.frames) {
+        run_frames(&arguments);
+        pool_destroy(thread_pool);
+        return 0;
     }
 
-    struct img img2;
-    img_init(&img2, img.width, img.height);
+    if (arguments.stream) {
+        run_stream(&arguments);
+        pool_destroy(thread_pool);
+        return 0;
+    }
 
-    struct img *src = &img;
-    struct img *dst = &img2;
+    if (arguments.shadow) {
+        run_shadow(&arguments);
+        pool_destroy(thread_pool);
+        return 0;
+    }
 
-    TIMER_START(hblur);
-    for (int i = 0; i < passes; i++) {
-        img_mov_avg_h(src, dst, blur_size);
-        PTR_SWAP(src, dst);
+    if (arguments.split_count > 0 || arguments.tile_index >= 0
+            || arguments.merge) {
+        if (arguments.split_count > 0) {
+            run_split(&arguments);
+        } else if (arguments.tile_index >= 0) {
+            run_tile(&arguments);
+        } else {
+            run_merge(&arguments);
+        }
+        pool_destroy(thread_pool);
+        return 0;
     }
-    TIMER_END(hblur);
 
-    img_transpose(src, dst);
-    PTR_SWAP(src, dst);
+    struct img img;
+    if (arguments.raw_image) {
+        img_load_raw(&img, arguments.input_file, &arguments.raw_fmt, arguments.fast_gamma);
+    } else {
+        img_load(&img, arguments.input_file, arguments.fast_gamma);
+    }
 
-    TIMER_START(vblur);
-    for (int i = 0; i < passes; i++) {
-        img_mov_avg_h(src, dst, blur_size);
-        PTR_SWAP(src, dst)
+    if (arguments.n_geoms > 1) {
+        run_variants(&arguments, &img);
+        free(img.pixels);
+        pool_destroy(thread_pool);
+        return 0;
     }
-    TIMER_END(vblur);
 
-    img_transpose(src, dst);
+    if (arguments.crop_mode == CROP_FILL) {
+        TIMER_START(resize);
+        img_resize_fill(&img, &arguments.geom);
+        TIMER_END(resize);
+    }
 
-    img_save_png(dst, arguments.output_file, arguments.fast_gamma);
+    struct img tmp;
+    struct img blurred;
+    img_init(&tmp, 0, 0, img.channels);
+    img_init(&blurred, 0, 0, img.channels);
+
+    struct encode_params params;
+    struct img *out = img_blur_args(&img, &blurred, &tmp, &arguments, &params,
+            NULL);
+
+    TIMER_START(encode);
+    img_save_png(out, arguments.output_file, &params, NULL);
+    TIMER_END(encode);
+
+    free(img.pixels);
+    free(tmp.pixels);
+    free(blurred.pixels);
+    pool_destroy(thread_pool);
 }
@@ -0,0 +1,1933 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "img.h"
+#include "pool.h"
+#include "probes.h"
+#include "scratch.h"
+
+const int pixel_format_size[FORMAT_COUNT] = {
+    [FORMAT_RGB]  = 3,
+    [FORMAT_RGBA] = 4,
+    [FORMAT_ARGB] = 4,
+    [FORMAT_BGR]  = 3,
+    [FORMAT_BGRA] = 4,
+    [FORMAT_ABGR] = 4
+};
+
+const int pixel_format_rgb_offset[FORMAT_COUNT][3] = {
+    [FORMAT_RGB]  = {0, 1, 2},
+    [FORMAT_RGBA] = {0, 1, 2},
+    [FORMAT_ARGB] = {1, 2, 3},
+    [FORMAT_BGR]  = {2, 1, 0},
+    [FORMAT_BGRA] = {2, 1, 0},
+    [FORMAT_ABGR] = {3, 2, 1}
+};
+
+float gamma_decode_lut[256];
+
+struct pool *thread_pool;
+
+/**
+ * Monotonic wall clock time in seconds.
+ */
+double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/**
+ * Set the size of an image.
+ *
+ * Data may or may not be preserved. If the image already fits the
+ * requested size, no allocations are made.
+ */
+void img_set_size(struct img *img, int width, int height, int channels)
+{
+    img->width = width;
+    img->height = height;
+    img->channels = channels;
+    img->stride = channels * width;
+    size_t size = sizeof(float) * img->stride * img->height;
+    if (!img->pixels || size > img->alloc_size) {
+        free(img->pixels);
+        img->alloc_size = size;
+        img->pixels = malloc(img->alloc_size);
+    }
+}
+
+/**
+ * Initialize an image to a size.
+ *
+ * img_set_size requires the image to be in a valid state. img_init sets
+ * the image to a valid state and then calls img_set_size.
+ */
+void img_init(struct img *img, int w, int h, int channels)
+{
+    img->pixels = NULL;
+    img->x_origin = 0;
+    img->y_origin = 0;
+    img_set_size(img, w, h, channels);
+}
+
+/**
+ * Initialize an image like img_init, with a buffer from a scratch pool.
+ *
+ * The buffer must be given back with img_put_scratch. It is still plain
+ * heap memory, so img_set_size may grow it.
+ */
+void img_init_scratch(struct img *img, int w, int h, int channels,
+        struct scratch *scratch)
+{
+    size_t size = sizeof(float) * channels * w * h;
+    img->pixels = scratch_get(scratch, size, &img->alloc_size);
+    img->x_origin = 0;
+    img->y_origin = 0;
+    img_set_size(img, w, h, channels);
+}
+
+/**
+ * Give the buffer of an image back to a scratch pool, or free it if
+ * scratch is NULL. The image is left without a buffer.
+ */
+void img_put_scratch(struct img *img, struct scratch *scratch)
+{
+    scratch_put(scratch, img->pixels, img->alloc_size);
+    img->pixels = NULL;
+    img->alloc_size = 0;
+}
+
+/*
+ * Row temporaries of the pool_for kernels. Each thread keeps one buffer,
+ * grown to the largest size it has needed, so once a run has warmed up
+ * the kernels no longer call the allocator. Kernels never wait on the
+ * pool, so a thread is only ever inside one of them at a time. The
+ * buffer of a thread is freed when it exits.
+ */
+struct task_buffer {
+    void *data;
+    size_t size;
+};
+
+static _Thread_local struct task_buffer task_buffer;
+static pthread_key_t task_buffer_key;
+static pthread_once_t task_buffer_once = PTHREAD_ONCE_INIT;
+
+static void task_buffer_key_create(void)
+{
+    pthread_key_create(&task_buffer_key, free);
+}
+
+/*
+ * Buffer of at least size bytes for the calling thread. Its contents are
+ * undefined, and it is only valid until the kernel returns.
+ */
+static void *task_buffer_get(size_t size)
+{
+    if (size > task_buffer.size) {
+        pthread_once(&task_buffer_once, task_buffer_key_create);
+        free(task_buffer.data);
+        task_buffer.data = malloc(size);
+        task_buffer.size = size;
+        pthread_setspecific(task_buffer_key, task_buffer.data);
+    }
+
+    return task_buffer.data;
+}
+
+/**
+ * Initialize the gamma decode lut.
+ *
+ * powf is slow. Use a lut to improve performance.
+ */
+void init_gamma_decode_lut()
+{
+    const float scale_factor = 1.0f / 255.0f;
+
+    for (size_t i = 0; i < 256; i++) {
+        gamma_decode_lut[i] = powf(i * scale_factor, GAMMA);
+    }
+}
+
+/**
+ * Decode gamma-encoded values.
+ *
+ * Fast gamma is an approximation that uses gamma=2.0 instead of the
+ * usual 2.2 for sRGB. Fast gamma improves encoding performance since
+ * there is no fast way to use a lut with floats.
+ */
+float gamma_decode_fast(uint8_t v)
+{
+    static const float scale_factor = 1.0f / 255.0f;
+
+    float x = v * scale_factor;
+    return x * x;
+}
+
+/**
+ * Gamma-encode a linear value.
+ */
+uint8_t gamma_encode(float v)
+{
+    static const float gamma_rcp = 1.0f / GAMMA;
+
+    return (uint8_t) (255.0f * powf(v, gamma_rcp) + 0.5f);
+}
+
+/**
+ * Gamma-encode a linear value.
+ *
+ * Uses the fast gamma approximation, which uses a call to sqrtf
+ * instead of powf.
+ */
+uint8_t gamma_encode_fast(float v)
+{
+    return (uint8_t) (255.0f * sqrtf(v) + 0.5f);
+}
+
+/*
+ * The gamma kernels below take the gamma mode as a constant parameter and
+ * are always inlined into one function per mode, so the per-element loops
+ * contain no branches. The mode is dispatched once per image, and rows
+ * are split across the thread pool.
+ */
+struct gamma_args {
+    struct img *img;
+    uint8_t *bitmap;
+    struct raw_image_format *fmt;
+    const struct encode_params *params;
+};
+
+ALWAYS_INLINE void gamma_decode_bitmap(struct gamma_args *args, int y0, int y1,
+        const bool fast_gamma)
+{
+    struct raw_image_format *fmt = args->fmt;
+    int pixel_size = pixel_format_size[fmt->format];
+    size_t begin = (size_t) fmt->width * y0;
+    size_t end = (size_t) fmt->width * y1;
+    const int *offset = pixel_format_rgb_offset[fmt->format];
+
+    for (size_t i = begin; i < end; i++) {
+        uint8_t *in = &args->bitmap[pixel_size * i];
+        float *out = &args->img->pixels[3 * i];
+        for (size_t c = 0; c < 3; c++) {
+            if (fast_gamma) {
+                out[c] = gamma_decode_fast(in[offset[c]]);
+            } else {
+                out[c] = gamma_decode_lut[in[offset[c]]];
+            }
+        }
+    }
+}
+
+static void gamma_decode_bitmap_fast(void *ctx, int y0, int y1)
+{
+    gamma_decode_bitmap(ctx, y0, y1, true);
+}
+
+static void gamma_decode_bitmap_lut(void *ctx, int y0, int y1)
+{
+    gamma_decode_bitmap(ctx, y0, y1, false);
+}
+
+/**
+ * Decode a bitmap into an initialized image, reusing its pixel buffer
+ * when it is large enough.
+ */
+void img_gamma_decode_bitmap_into(struct img *img, uint8_t *bitmap,
+        struct raw_image_format *fmt, bool fast_gamma)
+{
+    PROBE0(decode_start);
+    img_set_size(img, fmt->width, fmt->height, 3);
+
+    struct gamma_args args = { img, bitmap, fmt, NULL };
+    pool_for(thread_pool, img->height,
+            fast_gamma ? gamma_decode_bitmap_fast : gamma_decode_bitmap_lut,
+            &args);
+    PROBE3(decode_end, fmt->width, fmt->height, fmt->format);
+}
+
+void img_gamma_decode_bitmap(struct img *img, uint8_t *bitmap,
+        struct raw_image_format *fmt, bool fast_gamma)
+{
+    img_init(img, 0, 0, 3);
+    img_gamma_decode_bitmap_into(img, bitmap, fmt, fast_gamma);
+}
+
+/**
+ * Sharpen a row of blurred values in place using an unsharp mask.
+ *
+ * Differences between the source and the blur smaller than threshold
+ * are left unsharpened, which avoids amplifying noise.
+ */
+void unsharp_row(float *blur, const float *src, int n, float amount,
+        float threshold)
+{
+    for (int i = 0; i < n; i++) {
+        float d = src[i] - blur[i];
+        float v = fabsf(d) >= threshold ? src[i] + amount * d : src[i];
+        blur[i] = MIN(MAX(v, 0.0f), 1.0f);
+    }
+}
+
+/**
+ * Apply color adjustments to a row of linear RGB values in place.
+ *
+ * Brightness scales the values, saturation moves them away from or
+ * towards their luminance, and the tint mixes in the tint color scaled
+ * to the luminance, which keeps the shading of the image.
+ */
+void color_adjust_row(float *row, int width, const struct color_adjust *adjust)
+{
+    static const float luma[3] = { 0.2126f, 0.7152f, 0.0722f };
+
+    float tint_luma = luma[0] * adjust->tint[0] + luma[1] * adjust->tint[1]
+        + luma[2] * adjust->tint[2];
+    float tint[3];
+    for (int c = 0; c < 3; c++) {
+        tint[c] = tint_luma > 0.0f ? adjust->tint[c] / tint_luma : 1.0f;
+    }
+
+    float b = adjust->brightness;
+    float s = adjust->saturation;
+    float t = adjust->tint_amount;
+
+    for (int x = 0; x < width; x++) {
+        float *px = &row[3 * x];
+        float l = b * (luma[0] * px[0] + luma[1] * px[1] + luma[2] * px[2]);
+        for (int c = 0; c < 3; c++) {
+            float v = l + s * (b * px[c] - l);
+            v += t * (l * tint[c] - v);
+            px[c] = MIN(MAX(v, 0.0f), 1.0f);
+        }
+    }
+}
+
+ALWAYS_INLINE void gamma_encode_bitmap(struct gamma_args *args, int y0, int y1,
+        const bool fast_gamma)
+{
+    struct img *img = args->img;
+    const struct encode_params *params = args->params;
+    int row_size = img->channels * img->width;
+
+    for (int y = y0; y < y1; y++) {
+        float *row = &img->pixels[img->stride * y];
+        uint8_t *out_row = &args->bitmap[row_size * y];
+
+        if (params->unsharp_src) {
+            struct img *src = params->unsharp_src;
+            unsharp_row(row, &src->pixels[src->stride * y], row_size,
+                    params->unsharp_amount, params->unsharp_threshold);
+        }
+
+        if (params->adjust) {
+            color_adjust_row(row, img->width, params->adjust);
+        }
+
+        for (int i = 0; i < row_size; i++) {
+            if (fast_gamma) {
+                out_row[i] = gamma_encode_fast(row[i]);
+            } else {
+                out_row[i] = gamma_encode(row[i]);
+            }
+        }
+    }
+}
+
+static void gamma_encode_bitmap_fast(void *ctx, int y0, int y1)
+{
+    gamma_encode_bitmap(ctx, y0, y1, true);
+}
+
+static void gamma_encode_bitmap_pow(void *ctx, int y0, int y1)
+{
+    gamma_encode_bitmap(ctx, y0, y1, false);
+}
+
+/**
+ * Gamma-encode an image to an 8-bit bitmap.
+ *
+ * The operations in params are applied to each row just before it is
+ * encoded, while it is still in cache. They may modify img.
+ */
+void img_gamma_encode_into(struct img *img, uint8_t *bitmap,
+        const struct encode_params *params)
+{
+    PROBE3(encode_start, img->width, img->height, img->channels);
+    struct gamma_args args = { img, bitmap, NULL, params };
+    pool_for(thread_pool, img->height, params->fast_gamma
+            ? gamma_encode_bitmap_fast : gamma_encode_bitmap_pow, &args);
+    PROBE1(encode_end, (size_t) img->channels * img->width * img->height);
+}
+
+uint8_t *img_gamma_encode_to_bitmap(struct img *img,
+        const struct encode_params *params)
+{
+    size_t size = (size_t) img->channels * img->width * img->height;
+    uint8_t *bitmap = malloc(size);
+
+    img_gamma_encode_into(img, bitmap, params);
+
+    return bitmap;
+}
+
+/**
+ * Transpose an image.
+ *
+ * Since images are stored in row-major order, operations working in
+ * row-major order perform about 3x better than operations that work
+ * in column-major order. If many column-major operations are performed
+ * consecutively it may be faster to transpose the image before and
+ * after.
+ */
+struct img_pair {
+    struct img *src;
+    struct img *dst;
+};
+
+ALWAYS_INLINE void transpose(struct img_pair *args, int y0, int y1,
+        const int channels)
+{
+    struct img *src = args->src;
+    struct img *dst = args->dst;
+    size_t src_w = src->width;
+    size_t src_h = src->height;
+
+    for (size_t y = y0; y < y1; y++) {
+        for (size_t x = 0; x < src_w; x++) {
+            for (size_t c = 0; c < channels; c++) {
+                dst->pixels[IDX(src_h, y, x, channels) + c]
+                    = src->pixels[IDX(src_w, x, y, channels) + c];
+            }
+        }
+    }
+}
+
+#define TRANSPOSE_VARIANT(suffix, channels) \
+    static void transpose_ ## suffix(void *ctx, int y0, int y1) \
+    { struct img_pair *args = ctx; transpose(args, y0, y1, channels); }
+
+TRANSPOSE_VARIANT(c1, 1)
+TRANSPOSE_VARIANT(c2, 2)
+TRANSPOSE_VARIANT(c3, 3)
+TRANSPOSE_VARIANT(c4, 4)
+TRANSPOSE_VARIANT(c6, 6)
+TRANSPOSE_VARIANT(c24, 24)
+TRANSPOSE_VARIANT(c48, 48)
+TRANSPOSE_VARIANT(cn, args->src->channels)
+
+void img_transpose(struct img *src, struct img *dst)
+{
+    img_set_size(dst, src->height, src->width, src->channels);
+    dst->x_origin = src->y_origin;
+    dst->y_origin = src->x_origin;
+
+    pool_for_fn kernel;
+    switch (src->channels) {
+        case 1: kernel = transpose_c1; break;
+        case 2: kernel = transpose_c2; break;
+        case 3: kernel = transpose_c3; break;
+        case 4: kernel = transpose_c4; break;
+        case 6: kernel = transpose_c6; break;
+        case 24: kernel = transpose_c24; break;
+        case 48: kernel = transpose_c48; break;
+        default: kernel = transpose_cn; break;
+    }
+
+    PROBE3(transpose_start, src->width, src->height, src->channels);
+    struct img_pair args = { src, dst };
+    pool_for(thread_pool, src->height, kernel, &args);
+    PROBE0(transpose_end);
+}
+
+/**
+ * Creates a cropped view of an image.
+ *
+ * The cropped image points to the same data, but has a changed width
+ * and height, but not stride. The pointer points to the first pixel
+ * in the cropped image.
+ */
+struct img img_crop(struct img *src, int w, int h, int x, int y)
+{
+    return (struct img) { w, h, src->channels, src->stride, false, 0,
+            &src->pixels[y * src->stride + src->channels * x],
+            src->x_origin + x, src->y_origin + y };
+}
+
+/**
+ * Perform nearest neigbor scaling into dst, which must not be src.
+ */
+void img_interp_nearest_into(struct img *src, struct img *dst, int width,
+        int height)
+{
+    const float dst_width_rcp = 1.0f / width;
+    const float dst_height_rcp = 1.0f / height;
+    const int ch = src->channels;
+
+    img_set_size(dst, width, height, ch);
+    dst->x_origin = 0;
+    dst->y_origin = 0;
+
+    for (int y = 0; y < dst->height; y++) {
+        float *dst_row = &dst->pixels[dst->stride * y];
+
+        int y_src = MIN(y * src->height * dst_height_rcp + 0.5,
+                src->height - 1);
+        float *src_row = &src->pixels[src->stride * y_src];
+
+        for (int x = 0; x < dst->width; x++) {
+            int x_src = MIN(x * src->width * dst_width_rcp + 0.5,
+                    src->width - 1);
+
+            for (int c = 0; c < ch; c++) {
+                dst_row[ch * x + c] = src_row[ch * x_src + c];
+            }
+        }
+    }
+}
+
+/**
+ * Perform nearest neigbor scaling to a new image.
+ */
+struct img img_interp_nearest(struct img *src, int width, int height)
+{
+    struct img dst;
+    img_init(&dst, 0, 0, src->channels);
+    img_interp_nearest_into(src, &dst, width, height);
+
+    return dst;
+}
+
+void img_box2x2(struct img *src, struct img *dst)
+{
+    const int ch = src->channels;
+
+    img_set_size(dst, src->width / 2, src->height / 2, ch);
+    for (int y = 0; y < dst->height; y++) {
+        float *dst_row = &dst->pixels[dst->stride * y];
+        float *src_row = &src->pixels[src->stride * y * 2];
+        float *src_row2 = &src->pixels[src->stride * (y * 2 + 1)];
+
+        for (int x = 0; x < dst->width; x++) {
+            for (int c = 0; c < ch; c++) {
+                float sum = 0.0f;
+                sum += src_row[ch * 2 * x + c];
+                sum += src_row[ch * (2 * x + 1) + c];
+                sum += src_row2[ch * 2 * x + c];
+                sum += src_row2[ch * (2 * x + 1) + c];
+                dst_row[ch * x + c] = 0.25f * sum;
+            }
+        }
+    }
+}
+
+/*
+ * Dual filter downsampling kernel. Each output pixel is the average of
+ * its 2x2 source block, weighted 1/2, and of the four 2x2 blocks offset
+ * diagonally by one pixel, weighted 1/8 each. This is the same as 1/8 of
+ * the inner 2x2 plus 1/32 of the surrounding 4x4 source pixels.
+ *
+ * Column sums of the source rows are computed first, with the edge
+ * columns clamped into padding, so the horizontal step has no clamping.
+ */
+ALWAYS_INLINE void dual_down(struct img_pair *args, int y0, int y1,
+        const int channels)
+{
+    struct img *src = args->src;
+    struct img *dst = args->dst;
+    int w = src->width;
+    int h = src->height;
+
+    // Source columns -1 to w + 1. Packed batch images have up to 48
+    // channels, which is too much for the stack of a worker thread.
+    float *col_all = task_buffer_get(2 * sizeof(float) * channels * (w + 3));
+    float *col_inner = &col_all[channels * (w + 3)];
+
+    for (int y = y0; y < y1; y++) {
+        float *rows[4];
+        for (int i = 0; i < 4; i++) {
+            int sy = MIN(MAX(2 * y - 1 + i, 0), h - 1);
+            rows[i] = &src->pixels[src->stride * sy];
+        }
+
+        for (int x = 0; x < w + 3; x++) {
+            int sx = channels * MIN(MAX(x - 1, 0), w - 1);
+            for (int c = 0; c < channels; c++) {
+                float inner = rows[1][sx + c] + rows[2][sx + c];
+                col_inner[channels * x + c] = inner;
+                col_all[channels * x + c] = inner + rows[0][sx + c]
+                    + rows[3][sx + c];
+            }
+        }
+
+        float *dst_row = &dst->pixels[dst->stride * y];
+        for (int x = 0; x < dst->width; x++) {
+            float *all = &col_all[channels * 2 * x];
+            float *inner = &col_inner[channels * (2 * x + 1)];
+            for (int c = 0; c < channels; c++) {
+                float sum_inner = inner[c] + inner[channels + c];
+                float sum_all = all[c] + all[channels + c]
+                    + all[2 * channels + c] + all[3 * channels + c];
+                dst_row[channels * x + c] = 0.125f * sum_inner
+                    + 0.03125f * sum_all;
+            }
+        }
+    }
+}
+
+/*
+ * Dual filter upsampling kernel: a [1 2 1] tent filter followed by 2x
+ * bilinear interpolation. Combined, each output pixel is a separable
+ * 4-tap filter of the low resolution image, with taps depending on
+ * whether the output coordinate is even or odd.
+ */
+static const float dual_up_taps[2][4] = {
+    { 0.0625f, 0.3125f, 0.4375f, 0.1875f },
+    { 0.1875f, 0.4375f, 0.3125f, 0.0625f }
+};
+
+ALWAYS_INLINE void dual_up(struct img_pair *args, int y0, int y1,
+        const int channels)
+{
+    struct img *src = args->src;
+    struct img *dst = args->dst;
+    int w = src->width;
+    int h = src->height;
+
+    // Low resolution columns -2 to w + 1, off the stack like in dual_down
+    float *col = task_buffer_get(sizeof(float) * channels * (w + 4));
+
+    for (int y = y0; y < y1; y++) {
+        // Vertical taps into a low resolution row
+        const float *ty = dual_up_taps[y & 1];
+        int sy0 = (y >> 1) - 2 + (y & 1);
+        float *rows[4];
+        for (int i = 0; i < 4; i++) {
+            rows[i] = &src->pixels[src->stride * MIN(MAX(sy0 + i, 0), h - 1)];
+        }
+
+        float *inner = &col[2 * channels];
+        for (int i = 0; i < channels * w; i++) {
+            inner[i] = ty[0] * rows[0][i] + ty[1] * rows[1][i]
+                + ty[2] * rows[2][i] + ty[3] * rows[3][i];
+        }
+
+        for (int c = 0; c < channels; c++) {
+            col[c] = col[channels + c] = inner[c];
+            inner[channels * w + c] = inner[channels * (w + 1) + c]
+                = inner[channels * (w - 1) + c];
+        }
+
+        // Horizontal taps, two outputs per low resolution pixel
+        float *dst_row = &dst->pixels[dst->stride * y];
+        for (int x = 0; x < dst->width; x++) {
+            const float *tx = dual_up_taps[x & 1];
+            float *in = &col[channels * ((x >> 1) + (x & 1))];
+            for (int c = 0; c < channels; c++) {
+                dst_row[channels * x + c] = tx[0] * in[c]
+                    + tx[1] * in[channels + c] + tx[2] * in[2 * channels + c]
+                    + tx[3] * in[3 * channels + c];
+            }
+        }
+    }
+}
+
+#define DUAL_VARIANT(suffix, channels) \
+    static void dual_down_ ## suffix(void *ctx, int y0, int y1) \
+    { struct img_pair *args = ctx; dual_down(args, y0, y1, channels); } \
+    static void dual_up_ ## suffix(void *ctx, int y0, int y1) \
+    { struct img_pair *args = ctx; dual_up(args, y0, y1, channels); }
+
+DUAL_VARIANT(c1, 1)
+DUAL_VARIANT(c3, 3)
+DUAL_VARIANT(c4, 4)
+DUAL_VARIANT(c24, 24)
+DUAL_VARIANT(c48, 48)
+DUAL_VARIANT(cn, args->src->channels)
+
+/**
+ * Downsample an image by two using the dual filter kernel.
+ *
+ * Odd sizes are rounded up, with the edges clamped.
+ */
+void img_dual_down(struct img *src, struct img *dst)
+{
+    img_set_size(dst, (src->width + 1) / 2, (src->height + 1) / 2,
+            src->channels);
+
+    pool_for_fn kernel;
+    switch (src->channels) {
+        case 1: kernel = dual_down_c1; break;
+        case 3: kernel = dual_down_c3; break;
+        case 4: kernel = dual_down_c4; break;
+        case 24: kernel = dual_down_c24; break;
+        case 48: kernel = dual_down_c48; break;
+        default: kernel = dual_down_cn; break;
+    }
+
+    struct img_pair args = { src, dst };
+    pool_for(thread_pool, dst->height, kernel, &args);
+}
+
+/**
+ * Upsample an image by two to width x height using the dual filter
+ * kernel.
+ */
+void img_dual_up(struct img *src, struct img *dst, int width, int height)
+{
+    img_set_size(dst, width, height, src->channels);
+
+    pool_for_fn kernel;
+    switch (src->channels) {
+        case 1: kernel = dual_up_c1; break;
+        case 3: kernel = dual_up_c3; break;
+        case 4: kernel = dual_up_c4; break;
+        case 24: kernel = dual_up_c24; break;
+        case 48: kernel = dual_up_c48; break;
+        default: kernel = dual_up_cn; break;
+    }
+
+    struct img_pair args = { src, dst };
+    pool_for(thread_pool, dst->height, kernel, &args);
+}
+
+/**
+ * Halve an image n times with 2x2 box filtering. The buffer of img must
+ * come from scratch, and the buffer left over is given back to it.
+ */
+void img_decimate_scratch(struct img *img, int n, struct scratch *scratch)
+{
+    struct img tmp;
+    img_init_scratch(&tmp, img->width / 2, img->height / 2, img->channels,
+            scratch);
+    struct img *dst = &tmp;
+    struct img *src = img;
+
+    for (int i = 0; i < n; i++) {
+        img_box2x2(src, dst);
+        PTR_SWAP(src, dst);
+    }
+
+    img_put_scratch(dst, scratch);
+    *img = *src;
+}
+
+void img_decimate(struct img *img, int n)
+{
+    img_decimate_scratch(img, n, NULL);
+}
+
+/**
+ * Crop an image to the aspect ratio of geom and scale it to its size
+ * into dst, leaving the source unchanged.
+ */
+void img_fill_into(struct img *img, struct geometry *geom, struct img *dst)
+{
+    float crop_aspect_ratio = (float) geom->width / geom->height;
+    float img_aspect_ratio = (float) img->width / img->height;
+
+    int crop_w = img->width;
+    int crop_h = img->height;
+    int crop_x = 0;
+    int crop_y = 0;
+
+    if (crop_aspect_ratio > img_aspect_ratio) {
+        crop_h = (int) (img->width / crop_aspect_ratio + 0.5);
+        crop_y = (int) (geom->anchor * (img->height - crop_h) + 0.5);
+    } else {
+        crop_w = (int) (img->height * crop_aspect_ratio + 0.5);
+        crop_x = (int) (geom->anchor * (img->width - crop_w) + 0.5);
+    }
+
+    struct img cropped = img_crop(img, crop_w, crop_h, crop_x, crop_y);
+
+    img_interp_nearest_into(&cropped, dst, geom->width, geom->height);
+}
+
+struct img img_fill(struct img *img, struct geometry *geom)
+{
+    struct img dst;
+    img_init(&dst, 0, 0, img->channels);
+    img_fill_into(img, geom, &dst);
+
+    return dst;
+}
+
+/**
+ * Resize an image in place like img_fill. The buffer of img must come
+ * from scratch, and is given back to it for the resized one.
+ */
+void img_resize_fill_scratch(struct img *img, struct geometry *geom,
+        struct scratch *scratch)
+{
+    struct img resized;
+    img_init_scratch(&resized, geom->width, geom->height, img->channels,
+            scratch);
+    img_fill_into(img, geom, &resized);
+
+    img_put_scratch(img, scratch);
+    *img = resized;
+}
+
+void img_resize_fill(struct img *img, struct geometry *geom)
+{
+    img_resize_fill_scratch(img, geom, NULL);
+}
+
+/*
+ * Recursive moving average kernel.
+ *
+ * Written once for any channel count and instantiated by MOV_AVG_H_VARIANT
+ * with a constant count, which lets the compiler unroll the channel loops
+ * and keep the running sums in registers.
+ */
+struct mov_avg_args {
+    struct img *src;
+    struct img *dst;
+    int n;
+    // Length of each row's filter, or NULL to use n for every row
+    const int *sizes;
+};
+
+/**
+ * Distance between the points where the running sum of a moving average
+ * filter of length n is recomputed.
+ *
+ * Recomputing costs n additions, so the interval grows with n to keep
+ * the filter O(1) per pixel.
+ */
+int resync_interval(int n)
+{
+    return MAX(RESYNC_INTERVAL_MIN, 2 * n);
+}
+
+ALWAYS_INLINE void mov_avg_h(struct mov_avg_args *args, int y0, int y1,
+        const int channels)
+{
+    struct img *src = args->src;
+    struct img *dst = args->dst;
+    int w = src->width;
+    int origin = src->x_origin;
+
+    for (int y = y0; y < y1; y++) {
+        int n = args->sizes ? args->sizes[y] : args->n;
+        int interval = resync_interval(n);
+
+        float a = 1.0f / n;
+        int p = (n - 1) / 2;
+        int q = p + 1;
+
+        float *src_row = &src->pixels[src->stride * y];
+        float *dst_row = &dst->pixels[dst->stride * y];
+        float sum[channels];
+
+        // Compute first value using convolution. Since the edges are
+        // clamped, the left half is just multiplication.
+        for (int c = 0; c < channels; c++) {
+            sum[c] = src_row[c] * q * a;
+        }
+
+        for (int x = 1; x < q; x++) {
+            for (int c = 0; c < channels; c++) {
+                sum[c] += a * src_row[channels * MIN(x, w - 1) + c];
+            }
+        }
+
+        for (int c = 0; c < channels; c++) {
+            dst_row[c] = sum[c];
+        }
+
+        // Calculate remaining pixels recursively.
+        // y[n] = x[n - p] + ... + x[n + p] <=>
+        // y[n] = y[n - 1] + x[n + p] - x[n - q]
+        //
+        // Rounding errors accumulate in the running sum, so it is
+        // recomputed using convolution at every multiple of the resync
+        // interval, counted from the origin of the full image. This also
+        // makes the result independent of where the row starts, so tiles
+        // blur bit-identically to the full image.
+        int x = 1;
+        while (x < w) {
+            int offset = (origin + x) % interval;
+            if (offset == 0) {
+                for (int c = 0; c < channels; c++) {
+                    sum[c] = 0.0f;
+                }
+
+                for (int k = x - p; k <= x + p; k++) {
+                    float *in = &src_row[channels * MIN(MAX(k, 0), w - 1)];
+                    for (int c = 0; c < channels; c++) {
+                        sum[c] += a * in[c];
+                    }
+                }
+
+                for (int c = 0; c < channels; c++) {
+                    dst_row[channels * x + c] = sum[c];
+                }
+
+                x++;
+                offset = 1;
+            }
+
+            int end = MIN(w, x + interval - offset);
+            for (; x < end; x++) {
+                float *add = &src_row[channels * MIN(x + p, w - 1)];
+                float *sub = &src_row[channels * MAX(x - q, 0)];
+                for (int c = 0; c < channels; c++) {
+                    sum[c] += a * add[c] - a * sub[c];
+                    dst_row[channels * x + c] = sum[c];
+                }
+            }
+        }
+    }
+}
+
+#define MOV_AVG_H_VARIANT(suffix, channels) \
+    static void mov_avg_h_ ## suffix(void *ctx, int y0, int y1) \
+    { struct mov_avg_args *args = ctx; mov_avg_h(args, y0, y1, channels); }
+
+MOV_AVG_H_VARIANT(c1, 1)
+MOV_AVG_H_VARIANT(c2, 2)
+MOV_AVG_H_VARIANT(c3, 3)
+MOV_AVG_H_VARIANT(c4, 4)
+MOV_AVG_H_VARIANT(c6, 6)
+MOV_AVG_H_VARIANT(c24, 24)
+MOV_AVG_H_VARIANT(c48, 48)
+MOV_AVG_H_VARIANT(cn, args->src->channels)
+
+static void mov_avg_h_run(struct mov_avg_args *args)
+{
+    struct img *src = args->src;
+    struct img *dst = args->dst;
+
+    img_set_size(dst, src->width, src->height, src->channels);
+    dst->x_origin = src->x_origin;
+    dst->y_origin = src->y_origin;
+
+    pool_for_fn kernel;
+    switch (src->channels) {
+        case 1: kernel = mov_avg_h_c1; break;
+        case 2: kernel = mov_avg_h_c2; break;
+        case 3: kernel = mov_avg_h_c3; break;
+        case 4: kernel = mov_avg_h_c4; break;
+        case 6: kernel = mov_avg_h_c6; break;
+        case 24: kernel = mov_avg_h_c24; break;
+        case 48: kernel = mov_avg_h_c48; break;
+        default: kernel = mov_avg_h_cn; break;
+    }
+
+    pool_for(thread_pool, src->height, kernel, args);
+}
+
+/**
+ * Apply a recursive moving average filter horizontally.
+ *
+ * The recursive implementation is O(h * (w + n)) instead of
+ * O(w * w * n) for convolution. This improves performance drastically,
+ * especially for large values of n.
+ */
+void img_mov_avg_h(struct img *src, struct img *dst, int n)
+{
+    struct mov_avg_args args = { src, dst, n, NULL };
+    mov_avg_h_run(&args);
+}
+
+/**
+ * Apply a horizontal moving average with a separate odd length for each
+ * row, given in sizes. A length of 1 takes the same running sum path as
+ * any other, which reproduces the row up to rounding.
+ */
+void img_mov_avg_h_rows(struct img *src, struct img *dst, const int *sizes)
+{
+    struct mov_avg_args args = { src, dst, 0, sizes };
+    mov_avg_h_run(&args);
+}
+
+struct morph_args {
+    struct img *src;
+    struct img *dst;
+    int radius;
+};
+
+/*
+ * Running maximum or minimum over a window of 2r + 1 pixels, following
+ * van Herk and Gil and Werman. The row, padded with r copies of the edge
+ * pixels on both sides, is split into blocks of the window length. The
+ * maximum of a window is that of the suffix of the block it starts in
+ * and the prefix of the block it ends in, so each pixel costs three
+ * comparisons whatever the radius.
+ */
+ALWAYS_INLINE void morph_h(struct morph_args *args, int y0, int y1,
+        const int channels, const bool dilate)
+{
+    struct img *src = args->src;
+    struct img *dst = args->dst;
+    int w = src->width;
+    int r = args->radius;
+    int k = 2 * r + 1;
+    int n = w + 2 * r;
+
+    float *prefix = task_buffer_get(2 * sizeof(float) * channels * n);
+    float *suffix = &prefix[channels * n];
+
+#define MORPH_OP(a, b) (dilate ? MAX(a, b) : MIN(a, b))
+
+    for (int y = y0; y < y1; y++) {
+        float *src_row = &src->pixels[src->stride * y];
+        float *dst_row = &dst->pixels[dst->stride * y];
+
+        for (int p = 0, i = 0; p < n; p++, i++) {
+            float *v = &src_row[channels * MIN(MAX(p - r, 0), w - 1)];
+            if (i == k)
+                i = 0;
+            for (int c = 0; c < channels; c++) {
+                prefix[channels * p + c] = i == 0 ? v[c]
+                    : MORPH_OP(prefix[channels * (p - 1) + c], v[c]);
+            }
+        }
+
+        for (int p = n - 1; p >= 0; p--) {
+            float *v = &src_row[channels * MIN(MAX(p - r, 0), w - 1)];
+            bool block_end = p == n - 1 || p % k == k - 1;
+            for (int c = 0; c < channels; c++) {
+                suffix[channels * p + c] = block_end ? v[c]
+                    : MORPH_OP(suffix[channels * (p + 1) + c], v[c]);
+            }
+        }
+
+        for (int x = 0; x < w; x++) {
+            for (int c = 0; c < channels; c++) {
+                dst_row[channels * x + c] = MORPH_OP(suffix[channels * x + c],
+                        prefix[channels * (x + k - 1) + c]);
+            }
+        }
+    }
+
+#undef MORPH_OP
+}
+
+#define MORPH_H_VARIANT(suffix, channels) \
+    static void dilate_h_ ## suffix(void *ctx, int y0, int y1) \
+    { struct morph_args *args = ctx; morph_h(args, y0, y1, channels, true); } \
+    static void erode_h_ ## suffix(void *ctx, int y0, int y1) \
+    { struct morph_args *args = ctx; morph_h(args, y0, y1, channels, false); }
+
+MORPH_H_VARIANT(c1, 1)
+MORPH_H_VARIANT(c3, 3)
+MORPH_H_VARIANT(c4, 4)
+MORPH_H_VARIANT(cn, args->src->channels)
+
+void img_morph_h(struct img *src, struct img *dst, int radius, bool dilate)
+{
+    img_set_size(dst, src->width, src->height, src->channels);
+    dst->x_origin = src->x_origin;
+    dst->y_origin = src->y_origin;
+
+    pool_for_fn kernel;
+    switch (src->channels) {
+        case 1: kernel = dilate ? dilate_h_c1 : erode_h_c1; break;
+        case 3: kernel = dilate ? dilate_h_c3 : erode_h_c3; break;
+        case 4: kernel = dilate ? dilate_h_c4 : erode_h_c4; break;
+        default: kernel = dilate ? dilate_h_cn : erode_h_cn; break;
+    }
+
+    struct morph_args args = { src, dst, radius };
+    pool_for(thread_pool, src->height, kernel, &args);
+}
+
+/**
+ * Dilate or erode an image with a square of the given radius.
+ *
+ * Like the blur, this is separable, and the vertical pass runs on the
+ * transposed image. dst may be the same image as src.
+ */
+void img_dilate_erode(struct img *src, struct img *dst, struct img *tmp,
+        int radius, bool dilate)
+{
+    img_morph_h(src, tmp, radius, dilate);
+    img_transpose(tmp, dst);
+    img_morph_h(dst, tmp, radius, dilate);
+    img_transpose(tmp, dst);
+}
+
+/**
+ * Apply a morphological operation. Opening is an erosion followed by a
+ * dilation, which removes small bright features, and closing the
+ * reverse, which fills small dark ones.
+ */
+void img_morph(struct img *src, struct img *dst, struct img *tmp,
+        enum morph_op op, int radius)
+{
+    TIMER_START(morph);
+    switch (op) {
+        case MORPH_DILATE:
+        case MORPH_ERODE:
+            img_dilate_erode(src, dst, tmp, radius, op == MORPH_DILATE);
+            break;
+        case MORPH_OPEN:
+        case MORPH_CLOSE:
+            img_dilate_erode(src, dst, tmp, radius, op == MORPH_CLOSE);
+            img_dilate_erode(dst, dst, tmp, radius, op == MORPH_OPEN);
+            break;
+        default:
+            break;
+    }
+    TIMER_END(morph);
+}
+
+/**
+ * Blur an image using moving average passes in both directions.
+ *
+ * The vertical passes run on the transposed image, since operations in
+ * row-major order are much faster. The result is written to dst, which
+ * may be the same image as src. tmp is used as scratch space and must
+ * differ from both.
+ */
+void img_blur(struct img *src, struct img *dst, struct img *tmp, int passes,
+        int blur_size)
+{
+    // Every step writes to the other buffer. There is an even number of
+    // steps, so starting with tmp makes the last step write to dst.
+    struct img *in = src;
+    struct img *out = tmp;
+    struct img *next = dst;
+
+    TIMER_START(hblur);
+    for (int i = 0; i < passes; i++) {
+        PROBE3(pass_start, i, 0, blur_size);
+        img_mov_avg_h(in, out, blur_size);
+        PROBE2(pass_end, i, 0);
+        in = out;
+        PTR_SWAP(out, next);
+    }
+    TIMER_END(hblur);
+
+    img_transpose(in, out);
+    in = out;
+    PTR_SWAP(out, next);
+
+    TIMER_START(vblur);
+    for (int i = 0; i < passes; i++) {
+        PROBE3(pass_start, i, 1, blur_size);
+        img_mov_avg_h(in, out, blur_size);
+        PROBE2(pass_end, i, 1);
+        in = out;
+        PTR_SWAP(out, next);
+    }
+    TIMER_END(vblur);
+
+    img_transpose(in, out);
+}
+
+/**
+ * Odd moving average length for which the given number of passes has
+ * about the given per-axis variance, in pixels squared.
+ *
+ * A moving average of length n has variance (n^2 - 1) / 12.
+ */
+int blur_size_for_variance(double variance, int passes)
+{
+    int p = (int) (0.5 * sqrt(12 * MAX(variance, 0.0) / passes + 1));
+    return 2 * p + 1;
+}
+
+/**
+ * Blur an image using a dual filter (Kawase-style) pyramid.
+ *
+ * The image is downsampled by two a number of times and upsampled back,
+ * each step with a small fixed kernel. Each level doubles the blur
+ * radius at a quarter of the cost, so this is much cheaper than full
+ * resolution passes for large blurs, at the cost of a less gaussian
+ * shape.
+ *
+ * The number of levels is chosen so the blur variance matches the
+ * requested moving average passes. Whatever variance the levels do not
+ * reach is made up with moving average passes at the coarsest level.
+ * src is left untouched unless it is the same image as dst. The pyramid
+ * levels are taken from scratch, which may be NULL.
+ */
+void img_blur_dual(struct img *src, struct img *dst, struct img *tmp,
+        int passes, int blur_size, struct scratch *scratch)
+{
+    // Per-axis variance, in full resolution pixels, of n moving average
+    // passes and of the down and up kernels at level k, which are
+    // 3/4 * 4^(k - 1) and 11/16 * 4^k.
+    double target = passes * ((double) blur_size * blur_size - 1) / 12;
+
+    int levels = 0;
+    double reached = 0;
+    for (;;) {
+        double next = reached + 3.5 * pow(4, levels);
+        int min_size = MIN(src->width, src->height) >> (levels + 1);
+        if (next > target || min_size < 4)
+            break;
+
+        reached = next;
+        levels++;
+    }
+
+    double residual = (target - reached) / pow(4, levels);
+    int residual_size = blur_size_for_variance(residual, passes);
+
+    if (levels == 0) {
+        img_blur(src, dst, tmp, passes, residual_size);
+        return;
+    }
+
+    TIMER_START(dual);
+
+    struct img pyramid[levels];
+    struct img *prev = src;
+    for (int k = 0; k < levels; k++) {
+        img_init_scratch(&pyramid[k], (prev->width + 1) / 2,
+                (prev->height + 1) / 2, src->channels, scratch);
+        img_dual_down(prev, &pyramid[k]);
+        prev = &pyramid[k];
+    }
+
+    struct img *coarsest = &pyramid[levels - 1];
+    if (residual_size > 1) {
+        img_blur(coarsest, coarsest, tmp, passes, residual_size);
+    }
+
+    int width = src->width;
+    int height = src->height;
+    for (int k = levels - 1; k >= 0; k--) {
+        struct img *out = k > 0 ? &pyramid[k - 1] : dst;
+        int out_w = k > 0 ? pyramid[k - 1].width : width;
+        int out_h = k > 0 ? pyramid[k - 1].height : height;
+        img_dual_up(&pyramid[k], out, out_w, out_h);
+    }
+
+    for (int k = 0; k < levels; k++) {
+        img_put_scratch(&pyramid[k], scratch);
+    }
+
+    TIMER_END(dual);
+}
+
+/**
+ * Blur an image with the given engine. Temporaries other than tmp are
+ * taken from scratch, which may be NULL.
+ */
+void img_blur_engine(struct img *src, struct img *dst, struct img *tmp,
+        enum blur_engine engine, int passes, int blur_size,
+        struct scratch *scratch)
+{
+    if (engine == ENGINE_DUAL) {
+        img_blur_dual(src, dst, tmp, passes, blur_size, scratch);
+    } else {
+        img_blur(src, dst, tmp, passes, blur_size);
+    }
+}
+
+struct guided_args {
+    struct img *src;
+    struct img *dst;
+    struct img *work;
+    float eps;
+};
+
+/*
+ * Guided filter steps between the box filters. The work image holds two
+ * values per source channel, first the source and its square, then the
+ * coefficients a and b of the local linear model.
+ */
+static void guided_moments(void *ctx, int y0, int y1)
+{
+    struct guided_args *args = ctx;
+    struct img *src = args->src;
+    struct img *work = args->work;
+    int ch = src->channels;
+
+    for (int y = y0; y < y1; y++) {
+        float *in = &src->pixels[src->stride * y];
+        float *out = &work->pixels[work->stride * y];
+        for (int x = 0; x < src->width; x++) {
+            for (int c = 0; c < ch; c++) {
+                float v = in[ch * x + c];
+                out[2 * ch * x + c] = v;
+                out[2 * ch * x + ch + c] = v * v;
+            }
+        }
+    }
+}
+
+static void guided_coefficients(void *ctx, int y0, int y1)
+{
+    struct guided_args *args = ctx;
+    struct img *work = args->work;
+    int ch = work->channels / 2;
+    float eps = args->eps;
+
+    for (int y = y0; y < y1; y++) {
+        float *row = &work->pixels[work->stride * y];
+        for (int x = 0; x < work->width; x++) {
+            float *px = &row[2 * ch * x];
+            for (int c = 0; c < ch; c++) {
+                float mean = px[c];
+                float var = MAX(px[ch + c] - mean * mean, 0.0f);
+                float a = var / (var + eps);
+                px[c] = a;
+                px[ch + c] = mean - a * mean;
+            }
+        }
+    }
+}
+
+static void guided_output(void *ctx, int y0, int y1)
+{
+    struct guided_args *args = ctx;
+    struct img *src = args->src;
+    struct img *dst = args->dst;
+    struct img *work = args->work;
+    int ch = src->channels;
+
+    for (int y = y0; y < y1; y++) {
+        float *in = &src->pixels[src->stride * y];
+        float *out = &dst->pixels[dst->stride * y];
+        float *coef = &work->pixels[work->stride * y];
+        for (int x = 0; x < src->width; x++) {
+            for (int c = 0; c < ch; c++) {
+                float a = coef[2 * ch * x + c];
+                float b = coef[2 * ch * x + ch + c];
+                out[ch * x + c] = a * in[ch * x + c] + b;
+            }
+        }
+    }
+}
+
+/**
+ * Edge-preserving smoothing with a guided filter, using the image as its
+ * own guide.
+ *
+ * Each pixel is a local linear function a * I + b of the source, fitted
+ * in a window of the given radius. In flat regions the variance is much
+ * smaller than eps and a is close to 0, which smooths. At edges the
+ * variance dominates and a is close to 1, which keeps the edge.
+ *
+ * The filter is two box filters, each over the source values and a
+ * second quantity packed into the same image, so the cost does not
+ * depend on the radius. dst may be src. tmp and work are scratch images.
+ */
+void img_guided(struct img *src, struct img *dst, struct img *tmp,
+        struct img *work, int radius, float eps)
+{
+    int size = 2 * radius + 1;
+    struct guided_args args = { src, dst, work, eps };
+
+    TIMER_START(guided);
+    img_set_size(work, src->width, src->height, 2 * src->channels);
+    pool_for(thread_pool, src->height, guided_moments, &args);
+    img_blur(work, work, tmp, 1, size);
+
+    pool_for(thread_pool, src->height, guided_coefficients, &args);
+    img_blur(work, work, tmp, 1, size);
+
+    img_set_size(dst, src->width, src->height, src->channels);
+    pool_for(thread_pool, src->height, guided_output, &args);
+    TIMER_END(guided);
+}
+
+/*
+ * Median filter histograms. The fine histogram has a bin per value and
+ * the coarse one a bin per 16 values, which bounds the median search to
+ * 32 bins.
+ */
+#define MEDIAN_BINS 256
+#define MEDIAN_COARSE_SHIFT 4
+#define MEDIAN_COARSE_BINS (MEDIAN_BINS >> MEDIAN_COARSE_SHIFT)
+
+struct median_args {
+    const uint8_t *src;
+    uint8_t *dst;
+    int width;
+    int height;
+    int channels;
+    int radius;
+};
+
+/*
+ * Add one histogram and subtract another. The loops have a fixed length
+ * and vectorize to wide integer adds.
+ */
+ALWAYS_INLINE void hist_slide(uint32_t *restrict hist, const uint16_t *add,
+        const uint16_t *sub, const int bins)
+{
+    for (int i = 0; i < bins; i++) {
+        hist[i] += (uint32_t) add[i] - sub[i];
+    }
+}
+
+/*
+ * Window histogram of one channel. The coarse histogram is kept up to
+ * date for every pixel, but each 16 bin segment of the fine histogram
+ * only when the median falls in it, by sliding it from the column it was
+ * last updated at, or summing it from scratch if that is further away
+ * than the window width.
+ */
+struct median_kernel {
+    uint32_t fine[MEDIAN_BINS];
+    uint32_t coarse[MEDIAN_COARSE_BINS];
+    int updated[MEDIAN_COARSE_BINS];
+};
+
+ALWAYS_INLINE uint8_t kernel_median(struct median_kernel *kernel,
+        const uint16_t *fine, int x, int w, int ch, int r, uint32_t target)
+{
+    uint32_t sum = 0;
+    int b = 0;
+    while (sum + kernel->coarse[b] < target) {
+        sum += kernel->coarse[b++];
+    }
+
+    const int seg = MEDIAN_BINS / MEDIAN_COARSE_BINS;
+    uint32_t *hist = &kernel->fine[seg * b];
+    size_t offset = seg * b;
+
+    if (x - kernel->updated[b] > 2 * r + 1) {
+        memset(hist, 0, seg * sizeof(uint32_t));
+        for (int i = -r; i <= r; i++) {
+            const uint16_t *col = &fine[MEDIAN_BINS * ch * MIN(MAX(x + i, 0), w - 1)
+                + offset];
+            for (int k = 0; k < seg; k++) {
+                hist[k] += col[k];
+            }
+        }
+    } else {
+        for (int xx = kernel->updated[b] + 1; xx <= x; xx++) {
+            const uint16_t *in = &fine[MEDIAN_BINS * ch * MIN(xx + r, w - 1)
+                + offset];
+            const uint16_t *out = &fine[MEDIAN_BINS * ch * MAX(xx - r - 1, 0)
+                + offset];
+            hist_slide(hist, in, out, seg);
+        }
+    }
+    kernel->updated[b] = x;
+
+    int v = 0;
+    while (sum + hist[v] < target) {
+        sum += hist[v++];
+    }
+
+    return seg * b + v;
+}
+
+/*
+ * Median filter a band of rows, following Perreault and Hebert. Every
+ * column keeps a histogram of the 2r + 1 pixels around the current row,
+ * updated by one pixel in and one out per row. The window histogram
+ * slides along the row by adding the column entering it and subtracting
+ * the one leaving it. Both steps are independent of the radius.
+ *
+ * Edges are clamped, as in the blur.
+ */
+static void median_rows(void *ctx, int y0, int y1)
+{
+    struct median_args *args = ctx;
+    const uint8_t *src = args->src;
+    int w = args->width;
+    int h = args->height;
+    int ch = args->channels;
+    int r = args->radius;
+    size_t row_size = (size_t) ch * w;
+    uint32_t k = 2 * (uint32_t) r + 1;
+    uint32_t target = k * k / 2 + 1;
+
+    size_t fine_size = sizeof(uint16_t) * row_size * MEDIAN_BINS;
+    size_t coarse_size = sizeof(uint16_t) * row_size * MEDIAN_COARSE_BINS;
+    struct median_kernel *kernels = task_buffer_get(
+            sizeof(struct median_kernel) * ch + fine_size + coarse_size);
+    uint16_t *fine = (uint16_t *) &kernels[ch];
+    uint16_t *coarse = &fine[row_size * MEDIAN_BINS];
+    memset(fine, 0, fine_size + coarse_size);
+
+    for (int i = -r; i <= r; i++) {
+        const uint8_t *row = &src[row_size * MIN(MAX(y0 + i, 0), h - 1)];
+        for (size_t k = 0; k < row_size; k++) {
+            fine[MEDIAN_BINS * k + row[k]]++;
+            coarse[MEDIAN_COARSE_BINS * k + (row[k] >> MEDIAN_COARSE_SHIFT)]++;
+        }
+    }
+
+    for (int y = y0; y < y1; y++) {
+        if (y > y0) {
+            const uint8_t *out = &src[row_size * MAX(y - r - 1, 0)];
+            const uint8_t *in = &src[row_size * MIN(y + r, h - 1)];
+            for (size_t k = 0; k < row_size; k++) {
+                fine[MEDIAN_BINS * k + out[k]]--;
+                fine[MEDIAN_BINS * k + in[k]]++;
+                coarse[MEDIAN_COARSE_BINS * k + (out[k] >> MEDIAN_COARSE_SHIFT)]--;
+                coarse[MEDIAN_COARSE_BINS * k + (in[k] >> MEDIAN_COARSE_SHIFT)]++;
+            }
+        }
+
+        for (int c = 0; c < ch; c++) {
+            struct median_kernel *kernel = &kernels[c];
+            memset(kernel->coarse, 0, sizeof(kernel->coarse));
+            for (int i = -r; i <= r; i++) {
+                const uint16_t *col = &coarse[MEDIAN_COARSE_BINS
+                    * (ch * MIN(MAX(i, 0), w - 1) + c)];
+                for (int b = 0; b < MEDIAN_COARSE_BINS; b++) {
+                    kernel->coarse[b] += col[b];
+                }
+            }
+            for (int b = 0; b < MEDIAN_COARSE_BINS; b++) {
+                kernel->updated[b] = -2 * r - 2;
+            }
+        }
+
+        uint8_t *dst_row = &args->dst[row_size * y];
+        for (int x = 0; x < w; x++) {
+            size_t in = ch * MIN(x + r, w - 1);
+            size_t out = ch * MAX(x - r - 1, 0);
+            for (int c = 0; c < ch; c++) {
+                struct median_kernel *kernel = &kernels[c];
+                if (x > 0) {
+                    hist_slide(kernel->coarse,
+                            &coarse[MEDIAN_COARSE_BINS * (in + c)],
+                            &coarse[MEDIAN_COARSE_BINS * (out + c)],
+                            MEDIAN_COARSE_BINS);
+                }
+                dst_row[ch * x + c] = kernel_median(kernel, &fine[MEDIAN_BINS * c],
+                        x, w, ch, r, target);
+            }
+        }
+    }
+}
+
+/**
+ * Median filter an 8-bit bitmap in a square window of the given radius.
+ *
+ * The median commutes with gamma encoding, so this works on encoded
+ * values directly. The cost per pixel does not depend on the radius.
+ * Bands of rows are filtered in parallel, each starting its column
+ * histograms from the 2r + 1 rows around its first row. There is one
+ * band per thread, and no band is shorter than that window, so the
+ * setup never costs more than the band itself.
+ */
+void bitmap_median(const uint8_t *src, uint8_t *dst, int width, int height,
+        int channels, int radius)
+{
+    struct median_args args = { src, dst, width, height, channels, radius };
+    int n_bands = MIN(pool_threads(thread_pool), height / (2 * radius + 1));
+
+    TIMER_START(median);
+    pool_for_chunks(thread_pool, height, n_bands, median_rows, &args);
+    TIMER_END(median);
+}
+
+/*
+ * Linear luminance weights of the RGB primaries.
+ */
+static const float luma_weights[3] = { 0.2126f, 0.7152f, 0.0722f };
+
+struct luma_chroma_args {
+    struct img *rgb;
+    struct img *luma;
+    struct img *chroma;
+};
+
+/*
+ * Split rows of a linear RGB image into full resolution luminance Y and
+ * half resolution chroma R - Y and B - Y, averaged over 2x2 blocks.
+ * Edges of odd sized images are clamped. Works on rows of the chroma
+ * image, each covering two rows of the source.
+ */
+static void luma_chroma_split(void *ctx, int y0, int y1)
+{
+    struct luma_chroma_args *args = ctx;
+    struct img *rgb = args->rgb;
+    struct img *luma = args->luma;
+    struct img *chroma = args->chroma;
+    int w = rgb->width;
+
+    for (int cy = y0; cy < y1; cy++) {
+        float *c_row = &chroma->pixels[chroma->stride * cy];
+        for (int x = 0; x < chroma->width; x++) {
+            c_row[2 * x] = 0.0f;
+            c_row[2 * x + 1] = 0.0f;
+        }
+
+        for (int i = 0; i < 2; i++) {
+            int y = MIN(2 * cy + i, rgb->height - 1);
+            float *in = &rgb->pixels[rgb->stride * y];
+            float *y_row = &luma->pixels[luma->stride * y];
+
+            for (int x = 0; x < w; x++) {
+                float *px = &in[3 * x];
+                y_row[x] = luma_weights[0] * px[0] + luma_weights[1] * px[1]
+                    + luma_weights[2] * px[2];
+            }
+
+            for (int x = 0; x < chroma->width; x++) {
+                int xa = 2 * x;
+                int xb = MIN(2 * x + 1, w - 1);
+                c_row[2 * x] += 0.25f * (in[3 * xa] - y_row[xa]
+                        + in[3 * xb] - y_row[xb]);
+                c_row[2 * x + 1] += 0.25f * (in[3 * xa + 2] - y_row[xa]
+                        + in[3 * xb + 2] - y_row[xb]);
+            }
+        }
+    }
+}
+
+/*
+ * Recombine luminance with bilinearly upsampled chroma into RGB. Each
+ * full resolution pixel is a quarter of the way from its chroma pixel
+ * towards the neighboring one, so the weights are 3/4 and 1/4 in each
+ * direction. The chroma rows are first interpolated vertically. Near
+ * saturated color edges the interpolated chroma can take the result out
+ * of gamut, so it is clamped to [0, 1] before it reaches gamma_encode.
+ */
+static void luma_chroma_merge(void *ctx, int y0, int y1)
+{
+    struct luma_chroma_args *args = ctx;
+    struct img *rgb = args->rgb;
+    struct img *luma = args->luma;
+    struct img *chroma = args->chroma;
+    int w = rgb->width;
+    int cw = chroma->width;
+    int ch = chroma->height;
+    float c_row[2 * cw];
+    float g_scale = 1.0f / luma_weights[1];
+
+    for (int y = y0; y < y1; y++) {
+        int cy = y / 2;
+        int cy_near = MIN(MAX(y % 2 ? cy + 1 : cy - 1, 0), ch - 1);
+        float *row = &chroma->pixels[chroma->stride * cy];
+        float *near = &chroma->pixels[chroma->stride * cy_near];
+        for (int i = 0; i < 2 * cw; i++) {
+            c_row[i] = 0.75f * row[i] + 0.25f * near[i];
+        }
+
+        float *y_row = &luma->pixels[luma->stride * y];
+        float *out = &rgb->pixels[rgb->stride * y];
+        for (int x = 0; x < w; x++) {
+            int cx = x / 2;
+            int cx_near = MIN(MAX(x % 2 ? cx + 1 : cx - 1, 0), cw - 1);
+            float cr = 0.75f * c_row[2 * cx] + 0.25f * c_row[2 * cx_near];
+            float cb = 0.75f * c_row[2 * cx + 1]
+                + 0.25f * c_row[2 * cx_near + 1];
+
+            float l = y_row[x];
+            float r = l + cr;
+            float b = l + cb;
+            float g = (l - luma_weights[0] * r - luma_weights[2] * b) * g_scale;
+            out[3 * x] = MIN(MAX(r, 0.0f), 1.0f);
+            out[3 * x + 1] = MIN(MAX(g, 0.0f), 1.0f);
+            out[3 * x + 2] = MIN(MAX(b, 0.0f), 1.0f);
+        }
+    }
+}
+
+/**
+ * Blur a linear RGB image as luminance and half resolution chroma.
+ *
+ * Blurred images have little chroma detail, so the two chroma channels
+ * are blurred at a quarter of the pixels, with the blur size scaled to
+ * keep the same blur radius. That is half the filtering work of a full
+ * resolution RGB blur. dst may be src. The luminance and chroma planes
+ * are taken from scratch, which may be NULL.
+ */
+void img_blur_half_chroma(struct img *src, struct img *dst, struct img *tmp,
+        enum blur_engine engine, int passes, int blur_size,
+        struct scratch *scratch)
+{
+    struct img luma, chroma;
+    img_init_scratch(&luma, src->width, src->height, 1, scratch);
+    img_init_scratch(&chroma, (src->width + 1) / 2, (src->height + 1) / 2, 2,
+            scratch);
+
+    TIMER_START(chroma_split);
+    struct luma_chroma_args args = { src, &luma, &chroma };
+    pool_for(thread_pool, chroma.height, luma_chroma_split, &args);
+    TIMER_END(chroma_split);
+
+    img_blur_engine(&luma, &luma, tmp, engine, passes, blur_size, scratch);
+
+    // The 2x2 average and the bilinear upsampling each add about a
+    // quarter of a pixel squared of variance at full resolution
+    double variance = passes * ((double) blur_size * blur_size - 1) / 12;
+    int chroma_size = blur_size_for_variance((variance - 0.5) / 4, passes);
+    if (chroma_size > 1) {
+        img_blur_engine(&chroma, &chroma, tmp, engine, passes, chroma_size,
+                scratch);
+    }
+
+    img_set_size(dst, src->width, src->height, 3);
+    TIMER_START(chroma_merge);
+    args.rgb = dst;
+    pool_for(thread_pool, dst->height, luma_chroma_merge, &args);
+    TIMER_END(chroma_merge);
+
+    img_put_scratch(&luma, scratch);
+    img_put_scratch(&chroma, scratch);
+}
+
+/*
+ * Floats of a row that one task of img_mov_avg_v_rows filters together.
+ */
+#define PREFIX_STRIP 32
+
+struct mov_avg_rows_args {
+    struct img *src;
+    struct img *dst;
+    const int *sizes;
+    int max_radius;
+};
+
+/*
+ * A vertical moving average whose length changes from row to row cannot
+ * be a running sum, so each output row is the difference of two column
+ * prefix sums instead, which costs the same for any length. The sums are
+ * kept in doubles, since the difference of two long float sums loses the
+ * precision that short filters need.
+ */
+static void mov_avg_v_rows(void *ctx, int s0, int s1)
+{
+    struct mov_avg_rows_args *args = ctx;
+    struct img *src = args->src;
+    struct img *dst = args->dst;
+    int h = src->height;
+    int row_size = src->channels * src->width;
+    int r_max = args->max_radius;
+    int n_sums = h + 2 * r_max + 1;
+
+    double *sums = task_buffer_get(sizeof(double) * PREFIX_STRIP * n_sums);
+
+    for (int s = s0; s < s1; s++) {
+        int x0 = PREFIX_STRIP * s;
+        int strip = MIN(PREFIX_STRIP, row_size - x0);
+
+        // Row k of sums is the sum of rows -r_max to k - r_max - 1, with
+        // the edge rows repeated outside the image
+        for (int i = 0; i < strip; i++) {
+            sums[i] = 0.0;
+        }
+
+        for (int k = 0; k < n_sums - 1; k++) {
+            int y = MIN(MAX(k - r_max, 0), h - 1);
+            float *in = &src->pixels[src->stride * y + x0];
+            double *prev = &sums[PREFIX_STRIP * k];
+            double *next = prev + PREFIX_STRIP;
+            for (int i = 0; i < strip; i++) {
+                next[i] = prev[i] + in[i];
+            }
+        }
+
+        for (int y = 0; y < h; y++) {
+            int r = (args->sizes[y] - 1) / 2;
+            double a = 1.0 / args->sizes[y];
+            double *lo = &sums[PREFIX_STRIP * (y - r + r_max)];
+            double *hi = &sums[PREFIX_STRIP * (y + r + r_max + 1)];
+            float *out = &dst->pixels[dst->stride * y + x0];
+            for (int i = 0; i < strip; i++) {
+                out[i] = (float) (a * (hi[i] - lo[i]));
+            }
+        }
+    }
+}
+
+/**
+ * Apply a vertical moving average with a separate odd length for each
+ * output row, given in sizes. The cost does not depend on the lengths.
+ */
+void img_mov_avg_v_rows(struct img *src, struct img *dst, const int *sizes)
+{
+    img_set_size(dst, src->width, src->height, src->channels);
+    dst->x_origin = src->x_origin;
+    dst->y_origin = src->y_origin;
+
+    int max_size = 1;
+    for (int y = 0; y < src->height; y++) {
+        max_size = MAX(max_size, sizes[y]);
+    }
+
+    int row_size = src->channels * src->width;
+    struct mov_avg_rows_args args = { src, dst, sizes, (max_size - 1) / 2 };
+    pool_for(thread_pool, (row_size + PREFIX_STRIP - 1) / PREFIX_STRIP,
+            mov_avg_v_rows, &args);
+}
+
+/*
+ * Moving average length of each row of a tilt-shift blur. Rows in the
+ * band are left sharp, and the radius grows linearly from the edges of
+ * the band to the top and bottom of the image.
+ */
+static void tilt_shift_sizes(const struct tilt_shift *tilt, int height,
+        int *sizes)
+{
+    float top = (tilt->center - 0.5f * tilt->width) * height;
+    float bottom = (tilt->center + 0.5f * tilt->width) * height;
+    int max_radius = (tilt->max_size - 1) / 2;
+
+    for (int y = 0; y < height; y++) {
+        float center = y + 0.5f;
+        float t = 0.0f;
+        if (center < top) {
+            t = (top - center) / top;
+        } else if (center > bottom) {
+            t = (center - bottom) / (height - bottom);
+        }
+
+        sizes[y] = 2 * (int) (t * max_radius + 0.5f) + 1;
+    }
+}
+
+/**
+ * Blur an image with a tilt-shift effect: sharp in a horizontal band
+ * and increasingly blurred above and below it.
+ *
+ * Each row gets its own moving average length, in the horizontal passes
+ * through the running sums of img_mov_avg_h and in the vertical passes
+ * through column prefix sums. The cost is that of a single blur whatever
+ * the maximum size. dst may be src. The row sizes are kept in a buffer
+ * from scratch, which may be NULL.
+ */
+void img_blur_tilt_shift(struct img *src, struct img *dst, struct img *tmp,
+        int passes, const struct tilt_shift *tilt, struct scratch *scratch)
+{
+    size_t capacity;
+    int *sizes = scratch_get(scratch, sizeof(int) * src->height, &capacity);
+    tilt_shift_sizes(tilt, src->height, sizes);
+
+    // As in img_blur, the even number of steps ends in dst
+    struct img *in = src;
+    struct img *out = tmp;
+    struct img *next = dst;
+
+    TIMER_START(tilt_h);
+    for (int i = 0; i < passes; i++) {
+        img_mov_avg_h_rows(in, out, sizes);
+        in = out;
+        PTR_SWAP(out, next);
+    }
+    TIMER_END(tilt_h);
+
+    TIMER_START(tilt_v);
+    for (int i = 0; i < passes; i++) {
+        img_mov_avg_v_rows(in, out, sizes);
+        in = out;
+        PTR_SWAP(out, next);
+    }
+    TIMER_END(tilt_v);
+
+    scratch_put(scratch, sizes, capacity);
+}
+
+/**
+ * Pack same-sized images into the channels of one image.
+ *
+ * Channel c of image k becomes channel k * channels + c of the packed
+ * image. Filtering the packed image filters every image at once, with
+ * the images in separate SIMD lanes of the channel loop. This is much
+ * faster than filtering the images one by one when the rows are short.
+ */
+void img_pack(struct img **imgs, int count, struct img *dst)
+{
+    int w = imgs[0]->width;
+    int h = imgs[0]->height;
+    int ch = imgs[0]->channels;
+
+    img_set_size(dst, w, h, count * ch);
+
+    for (int y = 0; y < h; y++) {
+        float *dst_row = &dst->pixels[dst->stride * y];
+        for (int k = 0; k < count; k++) {
+            float *src_row = &imgs[k]->pixels[imgs[k]->stride * y];
+            for (int x = 0; x < w; x++) {
+                for (int c = 0; c < ch; c++) {
+                    dst_row[dst->channels * x + k * ch + c] = src_row[ch * x + c];
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Unpack images packed with img_pack.
+ */
+void img_unpack(struct img *src, struct img **imgs, int count)
+{
+    int w = src->width;
+    int h = src->height;
+    int ch = src->channels / count;
+
+    for (int k = 0; k < count; k++) {
+        img_set_size(imgs[k], w, h, ch);
+    }
+
+    for (int y = 0; y < h; y++) {
+        float *src_row = &src->pixels[src->stride * y];
+        for (int k = 0; k < count; k++) {
+            float *dst_row = &imgs[k]->pixels[imgs[k]->stride * y];
+            for (int x = 0; x < w; x++) {
+                for (int c = 0; c < ch; c++) {
+                    dst_row[ch * x + c] = src_row[src->channels * x + k * ch + c];
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Apply a recursive moving average filter vertically.
+ *
+ * The recursive implementation is O(h * (w + n)) instead of
+ * O(w * w * n) for convolution. This improves performance drastically,
+ * especially for large values of n.
+ *
+ * Due to images being stored in row-major order this is about 3x slower
+ * than img_mov_avg_h.
+ */
+void img_mov_avg_v(struct img *src, struct img *dst, int n)
+{
+    img_set_size(dst, src->width, src->height, src->channels);
+
+    int ch = src->channels;
+
+    int w = src->width;
+    int h = src->height;
+
+    float a = 1.0f / n;
+    int p = (n - 1) / 2;
+    int q = p + 1;
+
+    for (int x = 0; x < w; x++) {
+        float *src_col = src->pixels + ch * x;
+        float *dst_col = dst->pixels + ch * x;
+
+        // Compute first value using convolution. Since the edges are
+        // clamped, the left half is just multiplication.
+        for (int c = 0; c < ch; c++) {
+            dst_col[c] = src_col[c] * q * a;
+        }
+
+        for (int y = 1; y < q; y++) {
+            for (int c = 0; c < ch; c++) {
+                dst_col[c] += a * src_col[y * src->stride + c];
+            }
+        }
+
+        // Calculate remaining pixels recursively.
+        // y[n] = x[n - p] + ... + x[n + p] <=>
+        // y[n] = y[n - 1] + x[n + p] - x[n - q]
+        for (int y = 1; y < h; y++) {
+            for (int c = 0; c < ch; c++) {
+                dst_col[y * dst->stride + c] = dst_col[(y - 1) * dst->stride + c]
+                    + a * src_col[MIN(y + p, h - 1) * src->stride + c]
+                    - a * src_col[MAX(y - q, 0) * src->stride + c];
+            }
+        }
+    }
+}
@@ -0,0 +1,209 @@
+#ifndef IMG_H
+#define IMG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define GAMMA 2.2f
+
+/*
+ * Minimum distance between the points where the moving average running
+ * sum is recomputed from scratch.
+ */
+#define RESYNC_INTERVAL_MIN 256
+
+/*
+ * Largest median filter radius. Column histograms count the 2r + 1
+ * pixels of a column in 16 bits.
+ */
+#define MEDIAN_MAX_RADIUS 16383
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+#define IDX(w, x, y, s) ((s) * ((w) * (y) + (x)))
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+#define PTR_SWAP(a, b) { \
+    void *tmp = a; \
+    a = b; \
+    b = tmp; }
+
+#ifdef MEASURE_PERF_ENABLE
+#define TIMER_START(name) double _timer_ ## name = now_sec()
+#define TIMER_END(name) \
+    { double _timer_end_ = now_sec(); \
+        float _timer_duration_ms_ = 1000.0 * (_timer_end_ - _timer_ ## name); \
+        printf(#name ": %.2fms\n", _timer_duration_ms_); }
+#else
+#define TIMER_START(name) (void) 0
+#define TIMER_END(name) (void) 0
+#endif /* MEASURE_PERF_ENABLE */
+
+struct img {
+    int width;
+    int height;
+    int channels;
+    int stride;
+    bool owner;
+    size_t alloc_size;
+    float *pixels;
+    // Position of the image within the full image, when it is a tile
+    int x_origin;
+    int y_origin;
+};
+
+struct geometry {
+    int width;
+    int height;
+    float anchor;
+};
+
+enum morph_op {
+    MORPH_NONE,
+    MORPH_DILATE,
+    MORPH_ERODE,
+    MORPH_OPEN,
+    MORPH_CLOSE
+};
+
+enum blur_engine {
+    ENGINE_BOX,
+    ENGINE_DUAL
+};
+
+enum pixel_format {
+    FORMAT_RGB,
+    FORMAT_RGBA,
+    FORMAT_ARGB,
+    FORMAT_BGR,
+    FORMAT_BGRA,
+    FORMAT_ABGR,
+
+    FORMAT_COUNT
+};
+
+struct raw_image_format {
+    enum pixel_format format;
+    int width;
+    int height;
+};
+
+/*
+ * Color adjustments done in linear light after blurring. The tint color
+ * is linear.
+ */
+struct color_adjust {
+    float brightness;
+    float saturation;
+    float tint[3];
+    float tint_amount;
+};
+
+/*
+ * A tilt-shift blur, sharp in a horizontal band and blurred increasingly
+ * above and below it. center and width are fractions of the image height,
+ * and max_size is the moving average length at the top and bottom.
+ */
+struct tilt_shift {
+    float center;
+    float width;
+    int max_size;
+};
+
+/*
+ * Per-pixel operations fused into the final gamma encode.
+ */
+struct encode_params {
+    bool fast_gamma;
+    struct img *unsharp_src;
+    float unsharp_amount;
+    float unsharp_threshold;
+    struct color_adjust *adjust;
+};
+
+extern const int pixel_format_size[FORMAT_COUNT];
+extern const int pixel_format_rgb_offset[FORMAT_COUNT][3];
+
+extern float gamma_decode_lut[256];
+
+/*
+ * Pool the image operations spread their rows over. If NULL they run on
+ * the calling thread.
+ */
+extern struct pool *thread_pool;
+
+struct scratch;
+
+double now_sec();
+
+void img_set_size(struct img *img, int width, int height, int channels);
+void img_init(struct img *img, int w, int h, int channels);
+void img_init_scratch(struct img *img, int w, int h, int channels,
+        struct scratch *scratch);
+void img_put_scratch(struct img *img, struct scratch *scratch);
+
+void init_gamma_decode_lut();
+float gamma_decode_fast(uint8_t v);
+uint8_t gamma_encode(float v);
+uint8_t gamma_encode_fast(float v);
+void img_gamma_decode_bitmap_into(struct img *img, uint8_t *bitmap,
+        struct raw_image_format *fmt, bool fast_gamma);
+void img_gamma_decode_bitmap(struct img *img, uint8_t *bitmap,
+        struct raw_image_format *fmt, bool fast_gamma);
+void unsharp_row(float *blur, const float *src, int n, float amount,
+        float threshold);
+void color_adjust_row(float *row, int width, const struct color_adjust *adjust);
+void img_gamma_encode_into(struct img *img, uint8_t *bitmap,
+        const struct encode_params *params);
+uint8_t *img_gamma_encode_to_bitmap(struct img *img,
+        const struct encode_params *params);
+
+void img_transpose(struct img *src, struct img *dst);
+struct img img_crop(struct img *src, int w, int h, int x, int y);
+void img_interp_nearest_into(struct img *src, struct img *dst, int width,
+        int height);
+struct img img_interp_nearest(struct img *src, int width, int height);
+void img_box2x2(struct img *src, struct img *dst);
+void img_dual_down(struct img *src, struct img *dst);
+void img_dual_up(struct img *src, struct img *dst, int width, int height);
+void img_decimate_scratch(struct img *img, int n, struct scratch *scratch);
+void img_decimate(struct img *img, int n);
+void img_fill_into(struct img *img, struct geometry *geom, struct img *dst);
+struct img img_fill(struct img *img, struct geometry *geom);
+void img_resize_fill_scratch(struct img *img, struct geometry *geom,
+        struct scratch *scratch);
+void img_resize_fill(struct img *img, struct geometry *geom);
+
+int resync_interval(int n);
+void img_mov_avg_h(struct img *src, struct img *dst, int n);
+void img_mov_avg_h_rows(struct img *src, struct img *dst, const int *sizes);
+void img_mov_avg_v(struct img *src, struct img *dst, int n);
+void img_mov_avg_v_rows(struct img *src, struct img *dst, const int *sizes);
+void img_morph_h(struct img *src, struct img *dst, int radius, bool dilate);
+void img_dilate_erode(struct img *src, struct img *dst, struct img *tmp,
+        int radius, bool dilate);
+void img_morph(struct img *src, struct img *dst, struct img *tmp,
+        enum morph_op op, int radius);
+void img_blur(struct img *src, struct img *dst, struct img *tmp, int passes,
+        int blur_size);
+int blur_size_for_variance(double variance, int passes);
+void img_blur_dual(struct img *src, struct img *dst, struct img *tmp,
+        int passes, int blur_size, struct scratch *scratch);
+void img_blur_engine(struct img *src, struct img *dst, struct img *tmp,
+        enum blur_engine engine, int passes, int blur_size,
+        struct scratch *scratch);
+void img_guided(struct img *src, struct img *dst, struct img *tmp,
+        struct img *work, int radius, float eps);
+void img_blur_half_chroma(struct img *src, struct img *dst, struct img *tmp,
+        enum blur_engine engine, int passes, int blur_size,
+        struct scratch *scratch);
+void img_blur_tilt_shift(struct img *src, struct img *dst, struct img *tmp,
+        int passes, const struct tilt_shift *tilt, struct scratch *scratch);
+void bitmap_median(const uint8_t *src, uint8_t *dst, int width, int height,
+        int channels, int radius);
+void img_pack(struct img **imgs, int count, struct img *dst);
+void img_unpack(struct img *src, struct img **imgs, int count);
+
+#endif /* IMG_H */
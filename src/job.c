@@ -0,0 +1,442 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "job.h"
+#include "pool.h"
+#include "scratch.h"
+
+/*
+ * Free buffers each runner keeps for reuse, enough for the levels of a
+ * dual filter pyramid.
+ */
+#define RUNNER_SCRATCH_BUFFERS 16
+
+struct job {
+    struct job_queue *queue;
+    struct job_params params;
+    enum job_state state;
+    unsigned long seq;
+    int heap_index;
+    struct job *next;
+};
+
+/*
+ * Jobs wait in a binary heap ordered by priority and submission order.
+ * Runner threads take jobs from the heap one at a time, and the image
+ * operations of each job spread their rows over the thread pool, so a
+ * few runners keep small jobs from waiting behind a large one while all
+ * threads still work on the large one.
+ *
+ * Completed jobs without a callback are kept in a list for
+ * job_queue_poll, and the event fd is signalled, which lets an event
+ * loop wait for them along with its other file descriptors.
+ */
+struct job_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    struct job **heap;
+    int heap_size;
+    int heap_capacity;
+    unsigned long seq;
+    struct job *completed_head;
+    struct job *completed_tail;
+    int read_fd;
+    int write_fd;
+    bool owns_pool;
+    bool quit;
+    int n_runners;
+    pthread_t runners[];
+};
+
+static bool job_before(struct job *a, struct job *b)
+{
+    if (a->params.priority != b->params.priority)
+        return a->params.priority > b->params.priority;
+
+    return a->seq < b->seq;
+}
+
+static void heap_set(struct job_queue *queue, int i, struct job *job)
+{
+    queue->heap[i] = job;
+    job->heap_index = i;
+}
+
+static void heap_sift_up(struct job_queue *queue, int i)
+{
+    struct job *job = queue->heap[i];
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!job_before(job, queue->heap[parent]))
+            break;
+        heap_set(queue, i, queue->heap[parent]);
+        i = parent;
+    }
+    heap_set(queue, i, job);
+}
+
+static void heap_sift_down(struct job_queue *queue, int i)
+{
+    struct job *job = queue->heap[i];
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= queue->heap_size)
+            break;
+        if (child + 1 < queue->heap_size
+                && job_before(queue->heap[child + 1], queue->heap[child]))
+            child++;
+        if (!job_before(queue->heap[child], job))
+            break;
+        heap_set(queue, i, queue->heap[child]);
+        i = child;
+    }
+    heap_set(queue, i, job);
+}
+
+static void heap_push(struct job_queue *queue, struct job *job)
+{
+    if (queue->heap_size == queue->heap_capacity) {
+        queue->heap_capacity = queue->heap_capacity ? 2 * queue->heap_capacity
+            : 16;
+        queue->heap = realloc(queue->heap,
+                queue->heap_capacity * sizeof(struct job *));
+    }
+
+    heap_set(queue, queue->heap_size++, job);
+    heap_sift_up(queue, job->heap_index);
+}
+
+static void heap_remove(struct job_queue *queue, struct job *job)
+{
+    int i = job->heap_index;
+    struct job *last = queue->heap[--queue->heap_size];
+    if (last == job)
+        return;
+
+    heap_set(queue, i, last);
+    heap_sift_up(queue, i);
+    heap_sift_down(queue, last->heap_index);
+}
+
+static void queue_signal(struct job_queue *queue)
+{
+    uint64_t one = 1;
+    ssize_t size = queue->read_fd == queue->write_fd ? sizeof(one) : 1;
+    while (write(queue->write_fd, &one, size) < 0 && errno == EINTR)
+        ;
+}
+
+/*
+ * Mark a job as finished and notify its owner. Must be called with the
+ * lock held, which is released while a callback runs.
+ */
+static void job_complete(struct job *job, enum job_state state)
+{
+    struct job_queue *queue = job->queue;
+
+    job->state = state;
+    pthread_cond_broadcast(&queue->done);
+
+    if (job->params.callback) {
+        pthread_mutex_unlock(&queue->lock);
+        job->params.callback(job, job->params.user);
+        pthread_mutex_lock(&queue->lock);
+        return;
+    }
+
+    job->next = NULL;
+    if (queue->completed_tail) {
+        queue->completed_tail->next = job;
+    } else {
+        queue->completed_head = job;
+    }
+    queue->completed_tail = job;
+    queue_signal(queue);
+}
+
+static void job_run(struct job *job, struct img *img, struct img *tmp,
+        struct scratch *scratch)
+{
+    struct job_params *params = &job->params;
+    struct raw_image_format format = { params->format, params->width,
+        params->height };
+
+    img_gamma_decode_bitmap_into(img, (uint8_t *) params->src, &format,
+            params->fast_gamma);
+    img_blur_engine(img, img, tmp, params->engine, params->blur_passes,
+            params->blur_size, scratch);
+
+    struct encode_params encode = { params->fast_gamma };
+    img_gamma_encode_into(img, params->dst, &encode);
+}
+
+static void *job_runner(void *arg)
+{
+    struct job_queue *queue = arg;
+
+    // Buffers are kept across jobs, so steady state needs no allocations
+    struct img img, tmp;
+    img_init(&img, 0, 0, 3);
+    img_init(&tmp, 0, 0, 3);
+    struct scratch *scratch = scratch_create(RUNNER_SCRATCH_BUFFERS);
+
+    pthread_mutex_lock(&queue->lock);
+    while (!queue->quit) {
+        if (queue->heap_size == 0) {
+            pthread_cond_wait(&queue->work, &queue->lock);
+            continue;
+        }
+
+        struct job *job = queue->heap[0];
+        heap_remove(queue, job);
+        job->state = JOB_RUNNING;
+
+        pthread_mutex_unlock(&queue->lock);
+        job_run(job, &img, &tmp, scratch);
+        pthread_mutex_lock(&queue->lock);
+
+        job_complete(job, JOB_DONE);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    free(img.pixels);
+    free(tmp.pixels);
+    scratch_destroy(scratch);
+
+    return NULL;
+}
+
+static int queue_open_fds(struct job_queue *queue)
+{
+#ifdef __linux__
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd >= 0) {
+        queue->read_fd = queue->write_fd = fd;
+        return 0;
+    }
+#endif
+
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0)
+        return -1;
+
+    queue->read_fd = fds[0];
+    queue->write_fd = fds[1];
+    return 0;
+}
+
+/**
+ * Create a queue running jobs on n_runners threads.
+ *
+ * The image operations use the global thread pool, which is created
+ * with n_threads threads if it does not exist yet. Returns NULL on
+ * failure.
+ */
+struct job_queue *job_queue_create(int n_threads, int n_runners)
+{
+    if (n_runners < 1)
+        n_runners = 1;
+
+    struct job_queue *queue = calloc(1, sizeof(*queue)
+            + sizeof(pthread_t) * n_runners);
+    if (!queue)
+        return NULL;
+
+    if (queue_open_fds(queue) < 0) {
+        free(queue);
+        return NULL;
+    }
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->work, NULL);
+    pthread_cond_init(&queue->done, NULL);
+
+    init_gamma_decode_lut();
+    if (!thread_pool) {
+        thread_pool = pool_create(n_threads);
+        queue->owns_pool = true;
+    }
+
+    for (int i = 0; i < n_runners; i++) {
+        if (pthread_create(&queue->runners[i], NULL, job_runner, queue) != 0)
+            break;
+        queue->n_runners++;
+    }
+
+    if (queue->n_runners == 0) {
+        job_queue_destroy(queue);
+        return NULL;
+    }
+
+    return queue;
+}
+
+/**
+ * Destroy a queue. Queued jobs are cancelled and running jobs are
+ * finished first. Completed jobs not yet polled are freed.
+ */
+void job_queue_destroy(struct job_queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->quit = true;
+    while (queue->heap_size > 0) {
+        struct job *job = queue->heap[0];
+        heap_remove(queue, job);
+        job_complete(job, JOB_CANCELLED);
+    }
+    pthread_cond_broadcast(&queue->work);
+    pthread_mutex_unlock(&queue->lock);
+
+    for (int i = 0; i < queue->n_runners; i++) {
+        pthread_join(queue->runners[i], NULL);
+    }
+
+    while (queue->completed_head) {
+        struct job *job = queue->completed_head;
+        queue->completed_head = job->next;
+        free(job);
+    }
+
+    if (queue->owns_pool) {
+        pool_destroy(thread_pool);
+        thread_pool = NULL;
+    }
+
+    close(queue->read_fd);
+    if (queue->write_fd != queue->read_fd)
+        close(queue->write_fd);
+
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->work);
+    pthread_cond_destroy(&queue->done);
+    free(queue->heap);
+    free(queue);
+}
+
+/**
+ * File descriptor that becomes readable when jobs without a callback
+ * complete. When it does, call job_queue_poll until it returns NULL.
+ */
+int job_queue_fd(struct job_queue *queue)
+{
+    return queue->read_fd;
+}
+
+/**
+ * Take the next completed job without a callback, or return NULL if
+ * there is none. Does not block.
+ */
+struct job *job_queue_poll(struct job_queue *queue)
+{
+    uint64_t buf;
+    while (read(queue->read_fd, &buf, sizeof(buf)) > 0)
+        ;
+
+    pthread_mutex_lock(&queue->lock);
+    struct job *job = queue->completed_head;
+    if (job) {
+        queue->completed_head = job->next;
+        if (!queue->completed_head)
+            queue->completed_tail = NULL;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return job;
+}
+
+/**
+ * Queue a blur job. params is copied, but the src and dst buffers are
+ * used in place until the job completes. Returns NULL if the parameters
+ * are invalid.
+ */
+struct job *job_submit(struct job_queue *queue, const struct job_params *params)
+{
+    if (params->width < 1 || params->height < 1 || params->blur_passes < 1
+            || params->blur_size < 1 || params->blur_size % 2 == 0
+            || params->format < 0 || params->format >= FORMAT_COUNT)
+        return NULL;
+
+    struct job *job = malloc(sizeof(*job));
+    if (!job)
+        return NULL;
+
+    job->queue = queue;
+    job->params = *params;
+    job->state = JOB_QUEUED;
+    job->next = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    job->seq = queue->seq++;
+    heap_push(queue, job);
+    pthread_cond_signal(&queue->work);
+    pthread_mutex_unlock(&queue->lock);
+
+    return job;
+}
+
+/**
+ * Cancel a job that has not started. Returns false if it is already
+ * running or finished, in which case it completes normally.
+ */
+bool job_cancel(struct job *job)
+{
+    struct job_queue *queue = job->queue;
+
+    pthread_mutex_lock(&queue->lock);
+    bool queued = job->state == JOB_QUEUED;
+    if (queued) {
+        heap_remove(queue, job);
+        job_complete(job, JOB_CANCELLED);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return queued;
+}
+
+enum job_state job_state(struct job *job)
+{
+    pthread_mutex_lock(&job->queue->lock);
+    enum job_state state = job->state;
+    pthread_mutex_unlock(&job->queue->lock);
+
+    return state;
+}
+
+void *job_user(struct job *job)
+{
+    return job->params.user;
+}
+
+/**
+ * Block until a job is done or cancelled. Not for jobs whose callback
+ * frees them.
+ */
+void job_wait(struct job *job)
+{
+    struct job_queue *queue = job->queue;
+
+    pthread_mutex_lock(&queue->lock);
+    while (job->state == JOB_QUEUED || job->state == JOB_RUNNING) {
+        pthread_cond_wait(&queue->done, &queue->lock);
+    }
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Free a completed job. Jobs without a callback must have been taken
+ * with job_queue_poll first.
+ */
+void job_free(struct job *job)
+{
+    free(job);
+}
@@ -0,0 +1,63 @@
+#ifndef JOB_H
+#define JOB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "img.h"
+
+struct job;
+struct job_queue;
+
+enum job_state {
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_CANCELLED
+};
+
+/*
+ * A blur job. src is a packed bitmap of width * height pixels in format,
+ * and dst receives the blurred image as packed 8-bit RGB. Both must stay
+ * valid until the job completes.
+ *
+ * Jobs with a higher priority run first, and jobs of the same priority
+ * in submission order. If callback is set it is called from a worker
+ * thread when the job completes. Otherwise the job is queued for
+ * job_queue_poll and the queue's event fd is signalled.
+ */
+struct job_params {
+    const uint8_t *src;
+    uint8_t *dst;
+    int width;
+    int height;
+    enum pixel_format format;
+    enum blur_engine engine;
+    int blur_size;
+    int blur_passes;
+    bool fast_gamma;
+    int priority;
+    void (*callback)(struct job *job, void *user);
+    void *user;
+};
+
+struct job_queue *job_queue_create(int n_threads, int n_runners);
+void job_queue_destroy(struct job_queue *queue);
+int job_queue_fd(struct job_queue *queue);
+struct job *job_queue_poll(struct job_queue *queue);
+
+/*
+ * job_submit copies params, but not the buffers it points to. The job
+ * reads src and writes dst in place, so the caller must keep both alive
+ * and must not touch dst until the job has completed. That is when the
+ * callback runs, job_queue_poll returns the job, or job_wait returns. A
+ * job cancelled while still queued never touches the buffers.
+ */
+struct job *job_submit(struct job_queue *queue, const struct job_params *params);
+bool job_cancel(struct job *job);
+enum job_state job_state(struct job *job);
+void *job_user(struct job *job);
+void job_wait(struct job *job);
+void job_free(struct job *job);
+
+#endif /* JOB_H */
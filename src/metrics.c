@@ -0,0 +1,108 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+
+const double histogram_bounds[HISTOGRAM_BUCKETS] = {
+    0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+void histogram_observe(struct histogram *hist, double value)
+{
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (value <= histogram_bounds[i]) {
+            hist->buckets[i]++;
+            break;
+        }
+    }
+
+    hist->count++;
+    hist->sum += value;
+}
+
+void metrics_write_header(FILE *file, const char *name, const char *type,
+        const char *help)
+{
+    fprintf(file, "# HELP %s %s\n", name, help);
+    fprintf(file, "# TYPE %s %s\n", name, type);
+}
+
+/**
+ * Write one sample. labels is a comma separated list of name="value"
+ * pairs, or NULL.
+ */
+void metrics_write_value(FILE *file, const char *name, const char *labels,
+        double value)
+{
+    if (labels) {
+        fprintf(file, "%s{%s} %.15g\n", name, labels, value);
+    } else {
+        fprintf(file, "%s %.15g\n", name, value);
+    }
+}
+
+void metrics_write_histogram(FILE *file, const char *name, const char *labels,
+        const struct histogram *hist)
+{
+    const char *sep = labels ? "," : "";
+    if (!labels)
+        labels = "";
+
+    unsigned long cumulative = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        cumulative += hist->buckets[i];
+        fprintf(file, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, labels, sep,
+                histogram_bounds[i], cumulative);
+    }
+    fprintf(file, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, sep,
+            hist->count);
+
+    if (*labels) {
+        fprintf(file, "%s_sum{%s} %.15g\n", name, labels, hist->sum);
+        fprintf(file, "%s_count{%s} %lu\n", name, labels, hist->count);
+    } else {
+        fprintf(file, "%s_sum %.15g\n", name, hist->sum);
+        fprintf(file, "%s_count %lu\n", name, hist->count);
+    }
+}
+
+/**
+ * Replace a metrics file with what fn writes.
+ *
+ * The metrics are written to a temporary file next to pathname, which is
+ * then renamed over it, so a collector never reads a partial file. The
+ * temporary name does not end in .prom, which keeps the node exporter
+ * textfile collector from picking it up. Returns 0 or an errno value.
+ */
+int metrics_write_file(const char *pathname, metrics_write_fn fn, void *ctx)
+{
+    size_t size = strlen(pathname) + sizeof(".tmp");
+    char *tmp_pathname = malloc(size);
+    snprintf(tmp_pathname, size, "%s.tmp", pathname);
+
+    int error = 0;
+    FILE *file = fopen(tmp_pathname, "w");
+    if (!file) {
+        error = errno;
+        free(tmp_pathname);
+        return error;
+    }
+
+    fn(file, ctx);
+
+    if (ferror(file))
+        error = EIO;
+    if (fclose(file) != 0 && !error)
+        error = errno;
+    if (!error && rename(tmp_pathname, pathname) != 0)
+        error = errno;
+    if (error)
+        remove(tmp_pathname);
+
+    free(tmp_pathname);
+    return error;
+}
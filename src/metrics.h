@@ -0,0 +1,37 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+
+#define HISTOGRAM_BUCKETS 13
+
+/*
+ * Upper bounds in seconds of the histogram buckets. Observations above
+ * the last bound only count towards +Inf.
+ */
+extern const double histogram_bounds[HISTOGRAM_BUCKETS];
+
+/*
+ * A histogram of durations in the Prometheus sense. Each bucket counts
+ * the observations in it alone, and the counts are accumulated when the
+ * histogram is written.
+ */
+struct histogram {
+    unsigned long buckets[HISTOGRAM_BUCKETS];
+    unsigned long count;
+    double sum;
+};
+
+typedef void (*metrics_write_fn)(FILE *file, void *ctx);
+
+void histogram_observe(struct histogram *hist, double value);
+
+void metrics_write_header(FILE *file, const char *name, const char *type,
+        const char *help);
+void metrics_write_value(FILE *file, const char *name, const char *labels,
+        double value);
+void metrics_write_histogram(FILE *file, const char *name, const char *labels,
+        const struct histogram *hist);
+int metrics_write_file(const char *pathname, metrics_write_fn fn, void *ctx);
+
+#endif /* METRICS_H */
@@ -0,0 +1,225 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "pool.h"
+#include "probes.h"
+
+/*
+ * Chunks per thread in pool_for. More chunks balance uneven rows better
+ * at the cost of more queue traffic.
+ */
+#define CHUNKS_PER_THREAD 4
+
+struct pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    struct pool_task *head;
+    struct pool_task *tail;
+    bool quit;
+    int n_threads;
+    int n_workers;
+    pthread_t workers[];
+};
+
+static struct pool_task *pool_pop(struct pool *pool)
+{
+    struct pool_task *task = pool->head;
+    if (task) {
+        pool->head = task->next;
+        if (!pool->head)
+            pool->tail = NULL;
+    }
+
+    return task;
+}
+
+/*
+ * Run a task. Must be called with the lock held, which is released
+ * while the task runs.
+ */
+static void pool_run(struct pool *pool, struct pool_task *task)
+{
+    pthread_mutex_unlock(&pool->lock);
+    PROBE1(task_start, task);
+    task->fn(task->arg);
+    PROBE1(task_done, task);
+    pthread_mutex_lock(&pool->lock);
+
+    if (--task->group->pending == 0)
+        pthread_cond_broadcast(&pool->done);
+}
+
+static void *pool_worker(void *arg)
+{
+    struct pool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->quit) {
+        struct pool_task *task = pool_pop(pool);
+        if (task) {
+            pool_run(pool, task);
+        } else {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/**
+ * Create a pool running tasks on n_threads threads.
+ *
+ * The thread calling pool_wait counts as one of the threads, so a pool
+ * of one thread starts no workers and runs all tasks in pool_wait.
+ */
+struct pool *pool_create(int n_threads)
+{
+    if (n_threads < 1)
+        n_threads = 1;
+
+    struct pool *pool = malloc(sizeof(*pool)
+            + sizeof(pthread_t) * (n_threads - 1));
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->head = NULL;
+    pool->tail = NULL;
+    pool->quit = false;
+    pool->n_threads = n_threads;
+    pool->n_workers = 0;
+
+    for (int i = 0; i < n_threads - 1; i++) {
+        if (pthread_create(&pool->workers[i], NULL, pool_worker, pool) != 0)
+            break;
+        pool->n_workers++;
+    }
+
+    return pool;
+}
+
+void pool_destroy(struct pool *pool)
+{
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->n_workers; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    free(pool);
+}
+
+int pool_threads(struct pool *pool)
+{
+    return pool ? pool->n_workers + 1 : 1;
+}
+
+void pool_submit(struct pool *pool, struct pool_group *group,
+        struct pool_task *task, void (*fn)(void *arg), void *arg)
+{
+    task->fn = fn;
+    task->arg = arg;
+    task->group = group;
+    task->next = NULL;
+    PROBE1(task_dispatch, task);
+
+    pthread_mutex_lock(&pool->lock);
+    group->pending++;
+    if (pool->tail) {
+        pool->tail->next = task;
+    } else {
+        pool->head = task;
+    }
+    pool->tail = task;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Wait for all tasks in a group to complete.
+ *
+ * The waiting thread runs queued tasks, from any group, until the group
+ * is done. This keeps every thread busy and makes it safe to wait from
+ * inside a task.
+ */
+void pool_wait(struct pool *pool, struct pool_group *group)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (group->pending > 0) {
+        struct pool_task *task = pool_pop(pool);
+        if (task) {
+            pool_run(pool, task);
+        } else {
+            pthread_cond_wait(&pool->done, &pool->lock);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+struct pool_for_chunk {
+    pool_for_fn fn;
+    void *ctx;
+    int begin;
+    int end;
+};
+
+static void pool_for_run(void *arg)
+{
+    struct pool_for_chunk *chunk = arg;
+    chunk->fn(chunk->ctx, chunk->begin, chunk->end);
+}
+
+/**
+ * Call fn on n_chunks consecutive ranges covering [0, n) in parallel.
+ *
+ * Kernels with a setup cost per range use this to pick fewer, longer
+ * ranges than pool_for. Returns when all ranges are done. pool may be
+ * NULL, in which case fn is called once for the whole range.
+ */
+void pool_for_chunks(struct pool *pool, int n, int n_chunks, pool_for_fn fn,
+        void *ctx)
+{
+    if (n_chunks > n)
+        n_chunks = n;
+    if (pool_threads(pool) == 1 || n_chunks <= 1) {
+        fn(ctx, 0, n);
+        return;
+    }
+
+    struct pool_group group = { 0 };
+    struct pool_task tasks[n_chunks];
+    struct pool_for_chunk chunks[n_chunks];
+
+    for (int i = 0; i < n_chunks; i++) {
+        chunks[i] = (struct pool_for_chunk) { fn, ctx,
+            (long) n * i / n_chunks, (long) n * (i + 1) / n_chunks };
+        pool_submit(pool, &group, &tasks[i], pool_for_run, &chunks[i]);
+    }
+
+    pool_wait(pool, &group);
+}
+
+/**
+ * Call fn on consecutive ranges covering [0, n) in parallel, several per
+ * thread to balance uneven ranges.
+ *
+ * Returns when all ranges are done. pool may be NULL, in which case fn
+ * is called once for the whole range.
+ */
+void pool_for(struct pool *pool, int n, pool_for_fn fn, void *ctx)
+{
+    pool_for_chunks(pool, n, pool_threads(pool) * CHUNKS_PER_THREAD, fn, ctx);
+}
@@ -0,0 +1,39 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdbool.h>
+
+struct pool;
+
+/*
+ * A set of tasks that can be waited for together.
+ */
+struct pool_group {
+    int pending;
+};
+
+/*
+ * A queued unit of work. Tasks are owned by the submitter and must stay
+ * valid until the group they were submitted to has been waited for.
+ */
+struct pool_task {
+    void (*fn)(void *arg);
+    void *arg;
+    struct pool_group *group;
+    struct pool_task *next;
+};
+
+typedef void (*pool_for_fn)(void *ctx, int begin, int end);
+
+struct pool *pool_create(int n_threads);
+void pool_destroy(struct pool *pool);
+int pool_threads(struct pool *pool);
+
+void pool_submit(struct pool *pool, struct pool_group *group,
+        struct pool_task *task, void (*fn)(void *arg), void *arg);
+void pool_wait(struct pool *pool, struct pool_group *group);
+void pool_for(struct pool *pool, int n, pool_for_fn fn, void *ctx);
+void pool_for_chunks(struct pool *pool, int n, int n_chunks, pool_for_fn fn,
+        void *ctx);
+
+#endif /* POOL_H */
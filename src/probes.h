@@ -0,0 +1,45 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * USDT probes at stage boundaries, for tracing production hosts with
+ * bpftrace or perf without rebuilding. List them with
+ *
+ *     bpftrace -l 'usdt:/path/to/fastblur:*'
+ *
+ * With <sys/sdt.h> from systemtap, each probe is a nop and an ELF note,
+ * so it costs nothing until a tracer attaches. Without the header, or
+ * with -DNO_PROBES, the probes compile to nothing. Arguments must be
+ * integers or pointers.
+ *
+ * fastblur:load_start, load_end(width, height, channels)
+ *     An image file is decoded by stb_image.
+ * fastblur:decode_start, decode_end(width, height, format)
+ *     A bitmap is gamma-decoded to linear float.
+ * fastblur:pass_start(pass, axis, size), pass_end(pass, axis)
+ *     A moving average pass runs, with axis 0 for rows and 1 for columns.
+ * fastblur:transpose_start(width, height, channels), transpose_end
+ * fastblur:encode_start(width, height, channels), encode_end(bytes)
+ *     An image is gamma-encoded to an 8-bit bitmap of bytes bytes.
+ * fastblur:png_start(width, height, channels), png_end(bytes)
+ *     A bitmap is compressed to a PNG. bytes is 0 if it is written
+ *     straight to a file.
+ * fastblur:task_dispatch(task), task_start(task), task_done(task)
+ *     A thread pool task is queued, starts running and completes. The
+ *     task pointer pairs the three up.
+ */
+#if !defined(NO_PROBES) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+
+#define PROBE0(name) STAP_PROBE(fastblur, name)
+#define PROBE1(name, a) STAP_PROBE1(fastblur, name, a)
+#define PROBE2(name, a, b) STAP_PROBE2(fastblur, name, a, b)
+#define PROBE3(name, a, b, c) STAP_PROBE3(fastblur, name, a, b, c)
+#else
+#define PROBE0(name) (void) 0
+#define PROBE1(name, a) (void) 0
+#define PROBE2(name, a, b) (void) 0
+#define PROBE3(name, a, b, c) (void) 0
+#endif
+
+#endif /* PROBES_H */
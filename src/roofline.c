@@ -0,0 +1,323 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "img.h"
+#include "pool.h"
+#include "roofline.h"
+
+/*
+ * Elements in each array of the bandwidth test. Three arrays of 64 MiB
+ * are far larger than the last level cache.
+ */
+#define STREAM_SIZE (1 << 24)
+#define STREAM_CHUNKS 256
+
+/*
+ * Side length of the RGB test image the pipeline stages run on.
+ */
+#define STAGE_SIZE 2048
+
+/*
+ * Independent accumulators of the peak FLOP test, enough to keep the
+ * vector units busy despite the latency of each multiply and add, and
+ * repetitions per task.
+ */
+#define FLOPS_LANES 32
+#define FLOPS_REPS (1 << 22)
+#define FLOPS_TASKS_PER_THREAD 4
+
+/*
+ * Runs of each measurement. The fastest one counts.
+ */
+#define ROOFLINE_RUNS 5
+
+#define MAX_THREAD_COUNTS 40
+
+struct roofline_ctx {
+    // Bandwidth test
+    struct img a;
+    struct img b;
+    struct img c;
+    float scalar;
+
+    // Peak FLOP test
+    int flops_tasks;
+    float *flops_sums;
+
+    // Pipeline stages
+    struct img src;
+    struct img dst;
+    uint8_t *bitmap;
+    struct raw_image_format format;
+    int blur_size;
+    bool fast_gamma;
+};
+
+struct roof {
+    double copy_gbs;
+    double triad_gbs;
+    double gflops;
+};
+
+/*
+ * A pipeline stage with its memory traffic and floating point operations
+ * per channel value. Library calls such as powf count as one operation.
+ */
+struct stage {
+    const char *name;
+    void (*run)(struct roofline_ctx *ctx);
+    double bytes;
+    double flops;
+};
+
+static void stream_range(int begin, int end, size_t *i0, size_t *i1)
+{
+    *i0 = (size_t) STREAM_SIZE * begin / STREAM_CHUNKS;
+    *i1 = (size_t) STREAM_SIZE * end / STREAM_CHUNKS;
+}
+
+/*
+ * Pages are first touched by the threads that use them, which places them
+ * on the right NUMA nodes.
+ */
+static void stream_init(void *arg, int begin, int end)
+{
+    struct roofline_ctx *ctx = arg;
+
+    size_t i0, i1;
+    stream_range(begin, end, &i0, &i1);
+    for (size_t i = i0; i < i1; i++) {
+        ctx->a.pixels[i] = 0.0f;
+        ctx->b.pixels[i] = 1.0f;
+        ctx->c.pixels[i] = 2.0f;
+    }
+}
+
+static void stream_copy(void *arg, int begin, int end)
+{
+    struct roofline_ctx *ctx = arg;
+    float *a = ctx->a.pixels;
+    float *b = ctx->b.pixels;
+
+    size_t i0, i1;
+    stream_range(begin, end, &i0, &i1);
+    for (size_t i = i0; i < i1; i++) {
+        a[i] = b[i];
+    }
+}
+
+static void stream_triad(void *arg, int begin, int end)
+{
+    struct roofline_ctx *ctx = arg;
+    float *a = ctx->a.pixels;
+    float *b = ctx->b.pixels;
+    float *c = ctx->c.pixels;
+    float s = ctx->scalar;
+
+    size_t i0, i1;
+    stream_range(begin, end, &i0, &i1);
+    for (size_t i = i0; i < i1; i++) {
+        a[i] = b[i] + s * c[i];
+    }
+}
+
+static void flops_kernel(void *arg, int begin, int end)
+{
+    struct roofline_ctx *ctx = arg;
+    const float mul = 0.999f;
+    const float add = 0.001f;
+
+    for (int task = begin; task < end; task++) {
+        float acc[FLOPS_LANES];
+        for (int i = 0; i < FLOPS_LANES; i++) {
+            acc[i] = task + i;
+        }
+
+        for (long r = 0; r < FLOPS_REPS; r++) {
+            for (int i = 0; i < FLOPS_LANES; i++) {
+                acc[i] = acc[i] * mul + add;
+            }
+        }
+
+        float sum = 0.0f;
+        for (int i = 0; i < FLOPS_LANES; i++) {
+            sum += acc[i];
+        }
+        ctx->flops_sums[task] = sum;
+    }
+}
+
+static void run_copy(struct roofline_ctx *ctx)
+{
+    pool_for(thread_pool, STREAM_CHUNKS, stream_copy, ctx);
+}
+
+static void run_triad(struct roofline_ctx *ctx)
+{
+    pool_for(thread_pool, STREAM_CHUNKS, stream_triad, ctx);
+}
+
+static void run_flops(struct roofline_ctx *ctx)
+{
+    pool_for(thread_pool, ctx->flops_tasks, flops_kernel, ctx);
+}
+
+static void run_mov_avg_h(struct roofline_ctx *ctx)
+{
+    img_mov_avg_h(&ctx->src, &ctx->dst, ctx->blur_size);
+}
+
+static void run_transpose(struct roofline_ctx *ctx)
+{
+    img_transpose(&ctx->src, &ctx->dst);
+}
+
+static void run_gamma_decode(struct roofline_ctx *ctx)
+{
+    img_gamma_decode_bitmap_into(&ctx->src, ctx->bitmap, &ctx->format,
+            ctx->fast_gamma);
+}
+
+static void run_gamma_encode(struct roofline_ctx *ctx)
+{
+    struct encode_params params = { ctx->fast_gamma };
+    img_gamma_encode_into(&ctx->src, ctx->bitmap, &params);
+}
+
+static double time_best(void (*run)(struct roofline_ctx *ctx),
+        struct roofline_ctx *ctx)
+{
+    double best = INFINITY;
+    for (int i = 0; i < ROOFLINE_RUNS; i++) {
+        double start = now_sec();
+        run(ctx);
+        best = MIN(best, now_sec() - start);
+    }
+
+    return best;
+}
+
+static void measure_roof(struct roofline_ctx *ctx, int threads,
+        struct roof *roof)
+{
+    double copy_bytes = 2.0 * sizeof(float) * STREAM_SIZE;
+    double triad_bytes = 3.0 * sizeof(float) * STREAM_SIZE;
+    roof->copy_gbs = copy_bytes / time_best(run_copy, ctx) * 1e-9;
+    roof->triad_gbs = triad_bytes / time_best(run_triad, ctx) * 1e-9;
+
+    ctx->flops_tasks = FLOPS_TASKS_PER_THREAD * threads;
+    double flops = 2.0 * FLOPS_LANES * FLOPS_REPS * ctx->flops_tasks;
+    roof->gflops = flops / time_best(run_flops, ctx) * 1e-9;
+}
+
+/**
+ * Print a roofline report of this host and the pipeline stages.
+ *
+ * The roof is the memory bandwidth of a STREAM triad and the peak FLOP
+ * rate of independent multiply-adds. Each stage then runs on a test image
+ * at 1, 2, 4, ... up to max_threads threads, and its bandwidth and FLOP
+ * rate are reported as a fraction of the roof at the same thread count,
+ * max(GB/s / bandwidth, GFLOP/s / peak), along with the strong scaling
+ * efficiency t(1) / (n * t(n)). A stage far below the roof is limited by
+ * something else, like latency or poor vectorization, and one near the
+ * bandwidth roof only gets faster by moving fewer bytes.
+ */
+void roofline_report(int max_threads, int blur_size, bool fast_gamma)
+{
+    int thread_counts[MAX_THREAD_COUNTS];
+    int n_counts = 0;
+    for (int t = 1; t < max_threads && n_counts < MAX_THREAD_COUNTS - 1;
+            t *= 2) {
+        thread_counts[n_counts++] = t;
+    }
+    thread_counts[n_counts++] = max_threads;
+
+    struct roofline_ctx *ctx = calloc(1, sizeof(*ctx));
+    ctx->scalar = 3.0f;
+    ctx->blur_size = blur_size;
+    ctx->fast_gamma = fast_gamma;
+
+    // The bandwidth test uses the same allocator as the images
+    img_init(&ctx->a, STREAM_SIZE, 1, 1);
+    img_init(&ctx->b, STREAM_SIZE, 1, 1);
+    img_init(&ctx->c, STREAM_SIZE, 1, 1);
+    pool_for(thread_pool, STREAM_CHUNKS, stream_init, ctx);
+    ctx->flops_sums = malloc(sizeof(float) * FLOPS_TASKS_PER_THREAD
+            * max_threads);
+
+    ctx->format = (struct raw_image_format) { FORMAT_RGB, STAGE_SIZE,
+        STAGE_SIZE };
+    size_t n_values = (size_t) 3 * STAGE_SIZE * STAGE_SIZE;
+    ctx->bitmap = malloc(n_values);
+    srand(1);
+    for (size_t i = 0; i < n_values; i++) {
+        ctx->bitmap[i] = rand() & 0xff;
+    }
+    img_init(&ctx->src, 0, 0, 3);
+    img_init(&ctx->dst, 0, 0, 3);
+    img_gamma_decode_bitmap_into(&ctx->src, ctx->bitmap, &ctx->format,
+            fast_gamma);
+
+    const struct stage stages[] = {
+        { "mov_avg_h", run_mov_avg_h, 2 * sizeof(float),
+            4.0 + 2.0 * blur_size / resync_interval(blur_size) },
+        { "transpose", run_transpose, 2 * sizeof(float), 0.0 },
+        { "gamma_decode", run_gamma_decode, 1 + sizeof(float),
+            fast_gamma ? 2.0 : 0.0 },
+        { "gamma_encode", run_gamma_encode, sizeof(float) + 1, 3.0 },
+    };
+    const int n_stages = sizeof(stages) / sizeof(stages[0]);
+
+    struct roof roofs[MAX_THREAD_COUNTS];
+    double times[MAX_THREAD_COUNTS][n_stages];
+
+    struct pool *saved_pool = thread_pool;
+    for (int i = 0; i < n_counts; i++) {
+        thread_pool = pool_create(thread_counts[i]);
+
+        measure_roof(ctx, thread_counts[i], &roofs[i]);
+        for (int s = 0; s < n_stages; s++) {
+            times[i][s] = time_best(stages[s].run, ctx);
+        }
+
+        pool_destroy(thread_pool);
+    }
+    thread_pool = saved_pool;
+
+    printf("%-14s %7s %10s %10s %10s\n", "roof", "threads", "copy GB/s",
+            "triad GB/s", "GFLOP/s");
+    for (int i = 0; i < n_counts; i++) {
+        printf("%-14s %7d %10.2f %10.2f %10.2f\n", "", thread_counts[i],
+                roofs[i].copy_gbs, roofs[i].triad_gbs, roofs[i].gflops);
+    }
+
+    printf("\n%-14s %7s %10s %10s %10s %10s %10s\n", "stage", "threads", "ms",
+            "GB/s", "GFLOP/s", "roofline", "scaling");
+    for (int s = 0; s < n_stages; s++) {
+        for (int i = 0; i < n_counts; i++) {
+            double t = times[i][s];
+            double gbs = stages[s].bytes * n_values / t * 1e-9;
+            double gflops = stages[s].flops * n_values / t * 1e-9;
+            double roofline = MAX(gbs / roofs[i].triad_gbs,
+                    gflops / roofs[i].gflops);
+            double scaling = times[0][s] / (thread_counts[i] * t);
+
+            printf("%-14s %7d %10.2f %10.2f %10.2f %9.1f%% %9.1f%%\n",
+                    i == 0 ? stages[s].name : "", thread_counts[i], 1e3 * t,
+                    gbs, gflops, 100.0 * roofline, 100.0 * scaling);
+        }
+    }
+
+    free(ctx->a.pixels);
+    free(ctx->b.pixels);
+    free(ctx->c.pixels);
+    free(ctx->src.pixels);
+    free(ctx->dst.pixels);
+    free(ctx->bitmap);
+    free(ctx->flops_sums);
+    free(ctx);
+}
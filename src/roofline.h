@@ -0,0 +1,8 @@
+#ifndef ROOFLINE_H
+#define ROOFLINE_H
+
+#include <stdbool.h>
+
+void roofline_report(int max_threads, int blur_size, bool fast_gamma);
+
+#endif /* ROOFLINE_H */
@@ -0,0 +1,147 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "scratch.h"
+
+struct scratch_buffer {
+    void *data;
+    size_t capacity;
+};
+
+/*
+ * A pool of reusable buffers for the temporaries of a pipeline.
+ *
+ * Buffers taken with scratch_get are given back with scratch_put instead
+ * of being freed, and serve later requests that fit in them, so once a
+ * run of images has warmed the pool up it is processed without heap
+ * allocations. Buffers are plain malloc memory, so one that is not given
+ * back may still be freed or resized with img_set_size.
+ */
+struct scratch {
+    pthread_mutex_t lock;
+    unsigned long allocations;
+    int max_buffers;
+    int count;
+    struct scratch_buffer buffers[];
+};
+
+/**
+ * Create a scratch pool keeping up to max_buffers free buffers. Safe to
+ * use from several threads.
+ */
+struct scratch *scratch_create(int max_buffers)
+{
+    if (max_buffers < 1)
+        max_buffers = 1;
+
+    struct scratch *scratch = malloc(sizeof(*scratch)
+            + sizeof(struct scratch_buffer) * max_buffers);
+
+    pthread_mutex_init(&scratch->lock, NULL);
+    scratch->allocations = 0;
+    scratch->max_buffers = max_buffers;
+    scratch->count = 0;
+
+    return scratch;
+}
+
+void scratch_destroy(struct scratch *scratch)
+{
+    if (!scratch)
+        return;
+
+    for (int i = 0; i < scratch->count; i++) {
+        free(scratch->buffers[i].data);
+    }
+
+    pthread_mutex_destroy(&scratch->lock);
+    free(scratch);
+}
+
+/**
+ * Number of buffers the pool has had to allocate.
+ */
+unsigned long scratch_allocations(struct scratch *scratch)
+{
+    pthread_mutex_lock(&scratch->lock);
+    unsigned long allocations = scratch->allocations;
+    pthread_mutex_unlock(&scratch->lock);
+
+    return allocations;
+}
+
+/**
+ * Take a buffer of at least size bytes, the smallest free one that fits
+ * or a new one. Its size is stored in capacity, for scratch_put. If
+ * scratch is NULL the buffer is simply allocated.
+ */
+void *scratch_get(struct scratch *scratch, size_t size, size_t *capacity)
+{
+    if (scratch) {
+        pthread_mutex_lock(&scratch->lock);
+
+        int best = -1;
+        for (int i = 0; i < scratch->count; i++) {
+            size_t c = scratch->buffers[i].capacity;
+            if (c >= size && (best < 0 || c < scratch->buffers[best].capacity))
+                best = i;
+        }
+
+        if (best >= 0) {
+            struct scratch_buffer buffer = scratch->buffers[best];
+            scratch->buffers[best] = scratch->buffers[--scratch->count];
+            pthread_mutex_unlock(&scratch->lock);
+
+            *capacity = buffer.capacity;
+            return buffer.data;
+        }
+
+        scratch->allocations++;
+        pthread_mutex_unlock(&scratch->lock);
+    }
+
+    *capacity = size;
+    return malloc(size);
+}
+
+/**
+ * Give back a buffer of capacity bytes. When the pool is full, the
+ * smallest of its buffers and the given one is freed. If scratch is NULL
+ * the buffer is freed.
+ */
+void scratch_put(struct scratch *scratch, void *buffer, size_t capacity)
+{
+    if (!buffer)
+        return;
+
+    if (!scratch) {
+        free(buffer);
+        return;
+    }
+
+    struct scratch_buffer evicted = { buffer, capacity };
+
+    pthread_mutex_lock(&scratch->lock);
+    if (scratch->count < scratch->max_buffers) {
+        scratch->buffers[scratch->count++] = evicted;
+        evicted.data = NULL;
+    } else {
+        int smallest = 0;
+        for (int i = 1; i < scratch->count; i++) {
+            if (scratch->buffers[i].capacity
+                    < scratch->buffers[smallest].capacity)
+                smallest = i;
+        }
+
+        if (scratch->buffers[smallest].capacity < capacity) {
+            struct scratch_buffer kept = evicted;
+            evicted = scratch->buffers[smallest];
+            scratch->buffers[smallest] = kept;
+        }
+    }
+    pthread_mutex_unlock(&scratch->lock);
+
+    free(evicted.data);
+}
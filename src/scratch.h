@@ -0,0 +1,15 @@
+#ifndef SCRATCH_H
+#define SCRATCH_H
+
+#include <stddef.h>
+
+struct scratch;
+
+struct scratch *scratch_create(int max_buffers);
+void scratch_destroy(struct scratch *scratch);
+unsigned long scratch_allocations(struct scratch *scratch);
+
+void *scratch_get(struct scratch *scratch, size_t size, size_t *capacity);
+void scratch_put(struct scratch *scratch, void *buffer, size_t capacity);
+
+#endif /* SCRATCH_H */
@@ -1,3 +1,20 @@
+#include "img.h"
+#include "pool.h"
+
+/*
+ * Lets stb_image decode the restart intervals of a JPEG on the thread
+ * pool.
+ */
+static void stbi_parallel_for(int count, pool_for_fn fn, void *ctx)
+{
+    if (thread_pool) {
+        pool_for(thread_pool, count, fn, ctx);
+    } else {
+        fn(ctx, 0, count);
+    }
+}
+
+#define STBI_PARALLEL_FOR stbi_parallel_for
 #define STB_IMAGE_IMPLEMENTATION
 
 #include "stb_image.h"
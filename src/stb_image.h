@@ -15,6 +15,13 @@
    You can #define STBI_ASSERT(x) before the #include to avoid using assert.h.
    And #define STBI_MALLOC, STBI_REALLOC, and STBI_FREE to avoid using malloc,realloc,free
 
+   Local changes for fastblur: the zlib decoder has a wider fast table, a
+   64-bit bit buffer with a fast path that decodes literal pairs and copies
+   matches 8 bytes at a time, and the PNG sub, avg and paeth filters of
+   8-bit RGB and RGBA images are undone with SSE2. If STBI_PARALLEL_FOR is
+   defined, baseline JPEGs in memory with restart markers have their
+   restart intervals decoded in parallel.
+
 
    QUICK NOTES:
       Primarily of interest to game developers and other people who can
@@ -640,12 +647,14 @@ typedef unsigned short stbi__uint16;
 typedef   signed short stbi__int16;
 typedef unsigned int   stbi__uint32;
 typedef   signed int   stbi__int32;
+typedef unsigned __int64 stbi__uint64;
 #else
 #include <stdint.h>
 typedef uint16_t stbi__uint16;
 typedef int16_t  stbi__int16;
 typedef uint32_t stbi__uint32;
 typedef int32_t  stbi__int32;
+typedef uint64_t stbi__uint64;
 #endif
 
 // should produce compiler error if size is wrong
@@ -747,7 +756,7 @@ static int stbi__cpuid3(void)
 
 #define STBI_SIMD_ALIGN(type, name) __declspec(align(16)) type name
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if (!defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    int info3 = stbi__cpuid3();
@@ -758,7 +767,7 @@ static int stbi__sse2_available(void)
 #else // assume GCC-style if not VC++
 #define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if (!defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    // If we're even attempting to compile this on GCC/Clang, that means
@@ -2912,9 +2921,164 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
+#ifdef STBI_PARALLEL_FOR
+// Parallel decoding of baseline scans with restart markers. A restart
+// marker resets the entropy decoder and the DC predictions, so the
+// segments between markers decode independently, each into its own
+// blocks of the component planes. The scan is first searched for the
+// markers, which needs the whole file in memory.
+//
+// STBI_PARALLEL_FOR(count, fn, ctx) must call fn(ctx, begin, end) for
+// ranges covering [0, count), from any number of threads, and return
+// once all calls are done.
+
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi_uc **segment;   // start of each segment, then the end of the last
+   stbi_uc *failed;     // per segment
+   int n_mcus;
+} stbi__jpeg_segments;
+
+// decode one MCU of a baseline scan, in scan order
+static int stbi__jpeg_decode_mcu(stbi__jpeg *z, int mcu, short *data)
+{
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      int w = (z->img_comp[n].x+7) >> 3;
+      int i = mcu % w, j = mcu / w;
+      int ha = z->img_comp[n].ha;
+      if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+      z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+   } else {
+      int i = mcu % z->img_mcu_x, j = mcu / z->img_mcu_x;
+      int k,x,y;
+      for (k=0; k < z->scan_n; ++k) {
+         int n = z->order[k];
+         for (y=0; y < z->img_comp[n].v; ++y) {
+            for (x=0; x < z->img_comp[n].h; ++x) {
+               int x2 = (i*z->img_comp[n].h + x)*8;
+               int y2 = (j*z->img_comp[n].v + y)*8;
+               int ha = z->img_comp[n].ha;
+               if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
+            }
+         }
+      }
+   }
+   return 1;
+}
+
+static void stbi__jpeg_decode_segments(void *ctx, int begin, int end)
+{
+   stbi__jpeg_segments *segs = (stbi__jpeg_segments *) ctx;
+   int interval = segs->z->restart_interval;
+   stbi__context s;
+   STBI_SIMD_ALIGN(short, data[64]);
+   int i, mcu, last;
+
+   // the tables are shared, the decoder state is per thread
+   stbi__jpeg *z = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+   if (!z) {
+      for (i=begin; i < end; ++i) segs->failed[i] = 1;
+      return;
+   }
+   *z = *segs->z;
+   z->s = &s;
+
+   for (i=begin; i < end; ++i) {
+      stbi__start_mem(&s, segs->segment[i], (int) (segs->segment[i+1] - segs->segment[i]));
+      stbi__jpeg_reset(z);
+      last = (i+1) * interval < segs->n_mcus ? (i+1) * interval : segs->n_mcus;
+      for (mcu=i*interval; mcu < last; ++mcu) {
+         if (!stbi__jpeg_decode_mcu(z, mcu, data)) {
+            segs->failed[i] = 1;
+            break;
+         }
+      }
+   }
+
+   STBI_FREE(z);
+}
+
+// Returns -1 if the scan cannot be decoded in parallel, to decode it
+// serially instead.
+static int stbi__parse_entropy_coded_data_parallel(stbi__jpeg *z)
+{
+   stbi__jpeg_segments segs;
+   stbi_uc *p = z->s->img_buffer, *end = z->s->img_buffer_end, *q;
+   int n_segments, found = 0, i, ok = 1;
+
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      segs.n_mcus = ((z->img_comp[n].x+7) >> 3) * ((z->img_comp[n].y+7) >> 3);
+   } else {
+      segs.n_mcus = z->img_mcu_x * z->img_mcu_y;
+   }
+   n_segments = (segs.n_mcus + z->restart_interval - 1) / z->restart_interval;
+   if (n_segments < 2) return -1;
+
+   segs.z = z;
+   segs.segment = (stbi_uc **) stbi__malloc_mad2(n_segments + 1, sizeof(stbi_uc *), 0);
+   segs.failed = (stbi_uc *) stbi__malloc(n_segments);
+   if (!segs.segment || !segs.failed) {
+      STBI_FREE(segs.segment);
+      STBI_FREE(segs.failed);
+      return -1;
+   }
+   memset(segs.failed, 0, n_segments);
+
+   // find the restart markers and the marker that ends the scan, skipping
+   // stuffed zero bytes and fill bytes
+   segs.segment[0] = p;
+   while (p < end) {
+      if (*p != 0xff) { ++p; continue; }
+      q = p + 1;
+      while (q < end && *q == 0xff) ++q;
+      if (q == end) break;
+      if (*q == 0) {
+         p = q + 1;
+      } else if (STBI__RESTART(*q) && found + 1 < n_segments) {
+         segs.segment[++found] = q + 1;
+         p = q + 1;
+      } else {
+         segs.segment[++found] = p;
+         break;
+      }
+   }
+
+   if (found != n_segments || p == end) {
+      ok = -1;
+   } else {
+      // each segment but the last ends with its restart marker, which the
+      // decoder reads like the serial one does
+      STBI_PARALLEL_FOR(n_segments, stbi__jpeg_decode_segments, &segs);
+      for (i=0; i < n_segments; ++i)
+         if (segs.failed[i]) ok = stbi__err("bad huffman code","Corrupt JPEG");
+      if (ok) {
+         // continue after the marker that ends the scan, as if the
+         // serial decoder had just read it
+         for (q=p+1; *q == 0xff; ++q);
+         z->marker = *q;
+         z->s->img_buffer = q + 1;
+      }
+   }
+
+   STBI_FREE(segs.segment);
+   STBI_FREE(segs.failed);
+   return ok;
+}
+#endif
+
 static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 {
    stbi__jpeg_reset(z);
+#ifdef STBI_PARALLEL_FOR
+   if (!z->progressive && z->restart_interval && !z->s->read_from_callbacks) {
+      int ok = stbi__parse_entropy_coded_data_parallel(z);
+      if (ok >= 0) return ok;
+   }
+#endif
    if (!z->progressive) {
       if (z->scan_n == 1) {
          int i,j;
@@ -4031,7 +4195,7 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 #ifndef STBI_NO_ZLIB
 
 // fast-way is faster to check than jpeg huffman, but slow way is slower
-#define STBI__ZFAST_BITS  9 // accelerate all cases in default tables
+#define STBI__ZFAST_BITS  11 // accelerate all cases in default tables, and most dynamic codes
 #define STBI__ZFAST_MASK  ((1 << STBI__ZFAST_BITS) - 1)
 #define STBI__ZNSYMS 288 // number of symbols in literal/length alphabet
 
@@ -4129,6 +4293,7 @@ typedef struct
    int   z_expandable;
 
    stbi__zhuffman z_length, z_distance;
+   stbi__uint32 z_literal_pairs[1 << STBI__ZFAST_BITS];
 } stbi__zbuf;
 
 stbi_inline static int stbi__zeof(stbi__zbuf *z)
@@ -4237,11 +4402,177 @@ static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129
 static const int stbi__zdist_extra[32] =
 { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
 
+// Fast path of the huffman block decoder. The bit buffer is 64 bits wide
+// and refilled with a single unaligned load, after which it holds at
+// least 56 bits: enough for several literals, or for a length and
+// distance pair with their extra bits, without checking for input.
+// Pairs of short literal codes are decoded with one table lookup.
+// Matches are copied 8 bytes at a time, which may write up to 7 bytes
+// past their end. The loop hands over to the careful decoder close to the
+// end of the input or output buffer. On return, *done is set if the end
+// of block code was decoded, and the unused whole bytes of the bit buffer
+// are given back to the input, so the careful decoder can resume.
+
+#define STBI__ZFAST_IN   16              // two refills
+#define STBI__ZFAST_OUT  (7 + 258 + 8)   // seven literals, a match and its overrun
+
+// Second level of the fast table: for every fast index whose bits hold two
+// literal codes, both literals and their total length, which is at most
+// STBI__ZFAST_BITS. Zero if the bits start with anything else.
+static void stbi__zbuild_literal_pairs(stbi__zbuf *a)
+{
+   stbi__zhuffman *z = &a->z_length;
+   int i;
+   for (i=0; i < (1 << STBI__ZFAST_BITS); ++i) {
+      int b1 = z->fast[i], b2, s1, s2;
+      a->z_literal_pairs[i] = 0;
+      s1 = b1 >> 9;
+      if (!b1 || (b1 & 511) >= 256 || s1 >= STBI__ZFAST_BITS) continue;
+      // the second code only sees the bits after the first one, which
+      // are all real if it is short enough
+      b2 = z->fast[i >> s1];
+      s2 = b2 >> 9;
+      if (!b2 || (b2 & 511) >= 256 || s1 + s2 > STBI__ZFAST_BITS) continue;
+      a->z_literal_pairs[i] = (stbi__uint32) ((b1 & 255) | ((b2 & 255) << 8) | ((s1 + s2) << 16));
+   }
+}
+
+stbi_inline static stbi__uint64 stbi__zload64(const stbi_uc *p)
+{
+   stbi__uint64 v = 0;
+   int i;
+   for (i=0; i < 8; ++i)
+      v |= (stbi__uint64) p[i] << (8*i);
+   return v;
+}
+
+static int stbi__zhuffman_decode64_slowpath(stbi__zhuffman *z, stbi__uint64 *code_buffer, int *num_bits)
+{
+   int b,s,k;
+   k = stbi__bit_reverse((int) (*code_buffer & 0xffff), 16);
+   for (s=STBI__ZFAST_BITS+1; ; ++s)
+      if (k < z->maxcode[s])
+         break;
+   if (s >= 16) return -1; // invalid code!
+   b = (k >> (16-s)) - z->firstcode[s] + z->firstsymbol[s];
+   if (b >= STBI__ZNSYMS) return -1;
+   if (z->size[b] != s) return -1;
+   *code_buffer >>= s;
+   *num_bits -= s;
+   return z->value[b];
+}
+
+stbi_inline static int stbi__zhuffman_decode64(stbi__zhuffman *z, stbi__uint64 *code_buffer, int *num_bits)
+{
+   int b = z->fast[*code_buffer & STBI__ZFAST_MASK];
+   if (b) {
+      int s = b >> 9;
+      *code_buffer >>= s;
+      *num_bits -= s;
+      return b & 511;
+   }
+   return stbi__zhuffman_decode64_slowpath(z, code_buffer, num_bits);
+}
+
+static int stbi__parse_huffman_block_fast(stbi__zbuf *a, int *done)
+{
+   stbi_uc *zin = a->zbuffer;
+   stbi__uint64 code_buffer = a->code_buffer;
+   int num_bits = a->num_bits;
+   char *zout = a->zout;
+   int ok = 1;
+
+   #define STBI__ZREFILL() \
+      code_buffer |= stbi__zload64(zin) << num_bits, \
+      zin += (63 - num_bits) >> 3, \
+      num_bits |= 56
+
+   *done = 0;
+   while (a->zbuffer_end - zin >= STBI__ZFAST_IN && a->zout_end - zout >= STBI__ZFAST_OUT) {
+      stbi_uc *p;
+      int len,dist,z,e,i;
+
+      STBI__ZREFILL();
+      // up to three literal pairs and one more code fit in 56 bits
+      for (i=0; i < 3; ++i) {
+         stbi__uint32 pair = a->z_literal_pairs[code_buffer & STBI__ZFAST_MASK];
+         if (!pair) break;
+         zout[0] = (char) pair;
+         zout[1] = (char) (pair >> 8);
+         zout += 2;
+         code_buffer >>= pair >> 16;
+         num_bits -= pair >> 16;
+      }
+      z = stbi__zhuffman_decode64(&a->z_length, &code_buffer, &num_bits);
+      if (z < 256) {
+         if (z < 0) { ok = stbi__err("bad huffman code","Corrupt PNG"); break; }
+         *zout++ = (char) z;
+         continue;
+      }
+      STBI__ZREFILL();
+
+      if (z == 256) {
+         *done = 1;
+         break;
+      }
+      z -= 257;
+      len = stbi__zlength_base[z];
+      e = stbi__zlength_extra[z];
+      len += (int) (code_buffer & ((1 << e) - 1));
+      code_buffer >>= e;
+      num_bits -= e;
+
+      z = stbi__zhuffman_decode64(&a->z_distance, &code_buffer, &num_bits);
+      if (z < 0 || z >= 30) { ok = stbi__err("bad huffman code","Corrupt PNG"); break; }
+      dist = stbi__zdist_base[z];
+      e = stbi__zdist_extra[z];
+      dist += (int) (code_buffer & ((1 << e) - 1));
+      code_buffer >>= e;
+      num_bits -= e;
+      if (zout - a->zout_start < dist) { ok = stbi__err("bad dist","Corrupt PNG"); break; }
+
+      p = (stbi_uc *) (zout - dist);
+      if (dist >= 8) {
+         // every 8 byte chunk reads only bytes written before it
+         char *end = zout + len;
+         do {
+            memcpy(zout, p, 8);
+            zout += 8;
+            p += 8;
+         } while (zout < end);
+         zout = end;
+      } else if (dist == 1) { // run of one byte; common in images.
+         memset(zout, *p, len);
+         zout += len;
+      } else {
+         if (len) { do *zout++ = *p++; while (--len); }
+      }
+   }
+   #undef STBI__ZREFILL
+
+   // give back the whole bytes still in the bit buffer
+   zin -= num_bits >> 3;
+   num_bits &= 7;
+   a->zbuffer = zin;
+   a->code_buffer = (stbi__uint32) (code_buffer & ((1 << num_bits) - 1));
+   a->num_bits = num_bits;
+   a->zout = zout;
+   return ok;
+}
+
 static int stbi__parse_huffman_block(stbi__zbuf *a)
 {
    char *zout = a->zout;
    for(;;) {
-      int z = stbi__zhuffman_decode(a, &a->z_length);
+      int z;
+      if (a->zbuffer_end - a->zbuffer >= STBI__ZFAST_IN && a->zout_end - zout >= STBI__ZFAST_OUT) {
+         int done;
+         a->zout = zout;
+         if (!stbi__parse_huffman_block_fast(a, &done)) return 0;
+         if (done) return 1;
+         zout = a->zout;
+      }
+      z = stbi__zhuffman_decode(a, &a->z_length);
       if (z < 256) {
          if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
          if (zout >= a->zout_end) {
@@ -4423,6 +4754,7 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
          } else {
             if (!stbi__compute_huffman_codes(a)) return 0;
          }
+         stbi__zbuild_literal_pairs(a);
          if (!stbi__parse_huffman_block(a)) return 0;
       }
    } while (!final);
@@ -4590,6 +4922,104 @@ static int stbi__paeth(int a, int b, int c)
 
 static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
+#ifdef STBI_SSE2
+// SSE2 versions of the sub, avg and paeth filters for 8-bit pixels of 3 or
+// 4 bytes. Each pixel is predicted from the previous one, so the pixels
+// are done one at a time with all channels in one register. Pixels are
+// read img_n bytes apart from raw and written out_n bytes apart to cur,
+// with an opaque alpha byte added if out_n is one more than img_n. The
+// first pixel of the row is already done, and count more follow.
+// 3 byte pixels are moved as 2 + 1 bytes in registers; a 3 byte memcpy
+// goes through the stack and stalls store forwarding.
+stbi_inline static __m128i stbi__png_load_px(const stbi_uc *p, int n)
+{
+   int v;
+   if (n == 4) {
+      memcpy(&v, p, 4);
+   } else {
+      stbi__uint16 lo;
+      memcpy(&lo, p, 2);
+      v = lo | (p[2] << 16);
+   }
+   return _mm_cvtsi32_si128(v);
+}
+
+stbi_inline static void stbi__png_store_px(stbi_uc *p, __m128i v, int n, int out_n)
+{
+   int x = _mm_cvtsi128_si32(v);
+   if (n == 4) {
+      memcpy(p, &x, 4);
+   } else {
+      stbi__uint16 lo = (stbi__uint16) x;
+      memcpy(p, &lo, 2);
+      p[2] = (stbi_uc) (x >> 16);
+   }
+   if (out_n != n) p[n] = 255;
+}
+
+stbi_inline static int stbi__png_unfilter_sse2_n(stbi_uc *cur, stbi_uc *prior, stbi_uc *raw, int count, int img_n, int out_n, int filter)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i a = stbi__png_load_px(cur - out_n, img_n);
+   int i;
+
+   switch (filter) {
+      case STBI__F_sub:
+      case STBI__F_paeth_first: // paeth with no prior row picks the left pixel
+         for (i=0; i < count; ++i, cur+=out_n, raw+=img_n) {
+            a = _mm_add_epi8(a, stbi__png_load_px(raw, img_n));
+            stbi__png_store_px(cur, a, img_n, out_n);
+         }
+         return 1;
+      case STBI__F_avg: {
+         // _mm_avg_epu8 rounds up, the filter rounds down
+         __m128i one = _mm_set1_epi8(1);
+         for (i=0; i < count; ++i, cur+=out_n, prior+=out_n, raw+=img_n) {
+            __m128i b = stbi__png_load_px(prior, img_n);
+            __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+            a = _mm_add_epi8(avg, stbi__png_load_px(raw, img_n));
+            stbi__png_store_px(cur, a, img_n, out_n);
+         }
+         return 1;
+      }
+      case STBI__F_paeth: {
+         // in 16 bits, with p = a + b - c: |p - a| = |b - c|,
+         // |p - b| = |a - c| and |p - c| = |a - c + b - c|
+         __m128i c = _mm_unpacklo_epi8(stbi__png_load_px(prior - out_n, img_n), zero);
+         a = _mm_unpacklo_epi8(a, zero);
+         for (i=0; i < count; ++i, cur+=out_n, prior+=out_n, raw+=img_n) {
+            __m128i b = _mm_unpacklo_epi8(stbi__png_load_px(prior, img_n), zero);
+            __m128i pa = _mm_sub_epi16(b, c);
+            __m128i pb = _mm_sub_epi16(a, c);
+            __m128i pc = _mm_add_epi16(pa, pb);
+            __m128i not_a, c_over_b, pred, x;
+            pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+            pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+            pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+            not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+            c_over_b = _mm_cmpgt_epi16(pb, pc);
+            pred = _mm_or_si128(_mm_and_si128(c_over_b, c), _mm_andnot_si128(c_over_b, b));
+            pred = _mm_or_si128(_mm_and_si128(not_a, pred), _mm_andnot_si128(not_a, a));
+            x = _mm_add_epi8(_mm_packus_epi16(pred, pred), stbi__png_load_px(raw, img_n));
+            stbi__png_store_px(cur, x, img_n, out_n);
+            a = _mm_unpacklo_epi8(x, zero);
+            c = b;
+         }
+         return 1;
+      }
+   }
+   return 0;
+}
+
+// img_n is passed as a constant so the pixel loads and stores inline
+static int stbi__png_unfilter_sse2(stbi_uc *cur, stbi_uc *prior, stbi_uc *raw, int count, int img_n, int out_n, int filter)
+{
+   if (img_n == 3)
+      return stbi__png_unfilter_sse2_n(cur, prior, raw, count, 3, out_n, filter);
+   return stbi__png_unfilter_sse2_n(cur, prior, raw, count, 4, out_n, filter);
+}
+#endif
+
 // create the png data from post-deflated data
 static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
 {
@@ -4669,6 +5099,14 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
          prior += 1;
       }
 
+#ifdef STBI_SSE2
+      if (depth == 8 && (img_n == 3 || img_n == 4) && stbi__sse2_available()
+            && stbi__png_unfilter_sse2(cur, prior, raw, x-1, img_n, out_n, filter)) {
+         raw += (x-1)*img_n;
+         continue;
+      }
+#endif
+
       // this is a little gross, so that we don't switch per-pixel or per-component
       if (depth < 8 || img_n == out_n) {
          int nk = (width - 1)*filter_bytes;